@@ -0,0 +1,208 @@
+#!/bin/bash
+#
+# failover_bench.sh
+#
+# Measure fail over time of pg_promoter with a local primary and standby.
+#
+# For each way of killing primary server, this builds a primary and a
+# standby running pg_promoter, kills the primary and measures
+#
+#   detection : from killing primary until pg_promoter decides to promote
+#   promotion : from the decision until the standby leaves recovery
+#   write     : from killing primary until the first write on the standby
+#
+# and reports percentiles of them over the repeated runs, in milliseconds.
+#
+# PostgreSQL binaries must be in PATH, and pg_promoter must be installed.
+#
+# Usage: failover_bench.sh [-n runs] [-m modes] [-p port] [-t timeout] [-o 'pg_promoter settings']
+#
+#   -n runs   number of runs for each mode (default 10)
+#   -m modes  comma-separated list of sigkill, immediate and blockport
+#             (default all)
+#   -p port   port of primary server; standby uses port + 1 (default 5440)
+#   -t secs   give up a run if the standby can't be written within this many
+#             seconds after killing primary; the run is reported as failed
+#             (default 60)
+#   -o conf   extra pg_promoter settings for the standby, separated by
+#             semicolons (default 'pg_promoter.heartbeat_interval = 200ms')
+#
+# blockport drops packets to the primary with iptables if we are root,
+# otherwise freezes the primary with SIGSTOP, which looks the same from the
+# standby: connections are never answered.
+
+set -e
+
+RUNS=10
+MODES="sigkill,immediate,blockport"
+PORT=5440
+TIMEOUT=60
+OPTIONS="pg_promoter.heartbeat_interval = 200ms"
+
+while getopts "n:m:p:t:o:" opt; do
+	case $opt in
+		n) RUNS=$OPTARG ;;
+		m) MODES=$OPTARG ;;
+		p) PORT=$OPTARG ;;
+		t) TIMEOUT=$OPTARG ;;
+		o) OPTIONS=$OPTARG ;;
+		*) sed -n '2,/^$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+	esac
+done
+
+SPORT=$((PORT + 1))
+WORKDIR=$(mktemp -d -t pg_promoter_bench.XXXXXX)
+RESULTS="$WORKDIR/results"
+BLOCKED=""
+
+now() { date +%s.%N; }
+
+msec() { echo "$1 $2" | awk '{ printf "%.1f", ($2 - $1) * 1000 }'; }
+
+psql_standby() { psql -X -At -h 127.0.0.1 -p $SPORT -d postgres -c "$1" 2>/dev/null; }
+
+pid_of() { head -1 "$1/postmaster.pid"; }
+
+# Succeed if TIMEOUT seconds have passed since $1
+expired() { awk -v start="$1" -v now="$(now)" -v timeout=$TIMEOUT 'BEGIN { exit !(now - start >= timeout) }'; }
+
+cleanup()
+{
+	if [ -n "$BLOCKED" ]; then
+		iptables -D INPUT -p tcp --dport $PORT -j DROP 2>/dev/null || true
+		BLOCKED=""
+	fi
+	for d in "$WORKDIR/primary" "$WORKDIR/standby"; do
+		if [ -f "$d/postmaster.pid" ]; then
+			pkill -CONT -P "$(pid_of $d)" 2>/dev/null || true
+			kill -CONT "$(pid_of $d)" 2>/dev/null || true
+			pg_ctl -D "$d" -m immediate -w stop >/dev/null 2>&1 || true
+		fi
+	done
+	rm -rf "$WORKDIR/primary" "$WORKDIR/standby"
+}
+
+trap 'cleanup; rm -rf "$WORKDIR"' EXIT
+
+setup()
+{
+	initdb -D "$WORKDIR/primary" -A trust >/dev/null
+	cat >> "$WORKDIR/primary/postgresql.conf" <<EOC
+port = $PORT
+listen_addresses = '127.0.0.1'
+wal_level = hot_standby
+max_wal_senders = 4
+EOC
+	echo "host replication all 127.0.0.1/32 trust" >> "$WORKDIR/primary/pg_hba.conf"
+	pg_ctl -D "$WORKDIR/primary" -l "$WORKDIR/primary.log" -w start >/dev/null
+	psql -X -q -h 127.0.0.1 -p $PORT -d postgres -c "CREATE EXTENSION pg_promoter"
+
+	pg_basebackup -h 127.0.0.1 -p $PORT -D "$WORKDIR/standby" -X stream -R >/dev/null
+	cat >> "$WORKDIR/standby/postgresql.conf" <<EOC
+port = $SPORT
+hot_standby = on
+shared_preload_libraries = 'pg_promoter'
+pg_promoter.primary_conninfo = 'host=127.0.0.1 port=$PORT dbname=postgres connect_timeout=2'
+EOC
+	echo "$OPTIONS" | tr ';' '\n' >> "$WORKDIR/standby/postgresql.conf"
+	pg_ctl -D "$WORKDIR/standby" -l "$WORKDIR/standby.log" -w start >/dev/null
+
+	# Wait until pg_promoter on the standby sees the primary
+	for i in $(seq 1 300); do
+		[ "$(psql_standby "SELECT state FROM pg_promoter_status()")" = "healthy" ] && return 0
+		sleep 0.1
+	done
+	echo "pg_promoter on standby didn't become healthy" >&2
+	exit 1
+}
+
+kill_primary()
+{
+	case $1 in
+		sigkill)
+			kill -KILL "$(pid_of $WORKDIR/primary)"
+			;;
+		immediate)
+			pg_ctl -D "$WORKDIR/primary" -m immediate stop >/dev/null
+			;;
+		blockport)
+			if [ "$(id -u)" = 0 ] && iptables -I INPUT -p tcp --dport $PORT -j DROP 2>/dev/null; then
+				BLOCKED=yes
+			else
+				kill -STOP "$(pid_of $WORKDIR/primary)"
+				pkill -STOP -P "$(pid_of $WORKDIR/primary)"
+			fi
+			;;
+		*)
+			echo "unknown mode: $1" >&2
+			exit 1
+			;;
+	esac
+}
+
+run()
+{
+	local mode=$1 killed decided promoted written
+
+	setup
+	killed=$(now)
+	kill_primary $mode
+
+	# Wait until the standby leaves recovery
+	until [ "$(psql_standby "SELECT pg_is_in_recovery()")" = "f" ]; do
+		if expired $killed; then
+			echo "$mode: standby was not promoted within ${TIMEOUT}s" >&2
+			echo "$mode failed" >> "$RESULTS"
+			cleanup
+			return 0
+		fi
+		sleep 0.005
+	done
+	promoted=$(now)
+
+	# Wait until the first write succeeds
+	until psql_standby "CREATE TABLE IF NOT EXISTS bench_write (t timestamptz); INSERT INTO bench_write VALUES (now())" >/dev/null; do
+		if expired $killed; then
+			echo "$mode: standby didn't accept writes within ${TIMEOUT}s" >&2
+			echo "$mode failed" >> "$RESULTS"
+			cleanup
+			return 0
+		fi
+		sleep 0.005
+	done
+	written=$(now)
+
+	decided=$(psql_standby "SELECT extract(epoch FROM decision_time) FROM pg_promoter_status()")
+
+	echo "$mode detection $(msec $killed $decided)" >> "$RESULTS"
+	echo "$mode promotion $(msec $decided $promoted)" >> "$RESULTS"
+	echo "$mode write $(msec $killed $written)" >> "$RESULTS"
+
+	cleanup
+}
+
+for mode in ${MODES//,/ }; do
+	for i in $(seq 1 $RUNS); do
+		echo "running $mode $i/$RUNS" >&2
+		run $mode
+	done
+done
+
+# Report percentiles by nearest rank, and the number of failed runs
+printf "%-10s %-10s %5s %10s %10s %10s %10s\n" mode metric runs p50 p90 p99 max
+for mode in ${MODES//,/ }; do
+	failed=$(awk -v mode=$mode '$1 == mode && $2 == "failed"' "$RESULTS" | wc -l)
+	[ "$failed" -gt 0 ] && printf "%-10s %-10s %5d\n" $mode failed $failed
+	for metric in detection promotion write; do
+		awk -v mode=$mode -v metric=$metric '$1 == mode && $2 == metric { print $3 }' "$RESULTS" |
+			sort -n |
+			awk -v mode=$mode -v metric=$metric '
+				{ v[NR] = $1 }
+				function pct(p,   r) { r = int(p * NR + 0.999999); if (r < 1) r = 1; return v[r] }
+				END {
+					if (NR > 0)
+						printf "%-10s %-10s %5d %10.1f %10.1f %10.1f %10.1f\n",
+							mode, metric, NR, pct(0.5), pct(0.9), pct(0.99), v[NR]
+				}'
+	done
+done
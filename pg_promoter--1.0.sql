@@ -0,0 +1,83 @@
+/* pg_promoter/pg_promoter--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_promoter" to load this file. \quit
+
+-- Heartbeat table, written by primary server and read by standby servers.
+CREATE TABLE pg_promoter_heartbeat (
+    id integer PRIMARY KEY CHECK (id = 1),
+    beat_time timestamp with time zone NOT NULL
+);
+INSERT INTO pg_promoter_heartbeat VALUES (1, now());
+
+-- Register functions.
+CREATE FUNCTION pg_promoter_status(
+    OUT pid integer,
+    OUT state text,
+    OUT last_probe_time timestamp with time zone,
+    OUT last_success_time timestamp with time zone,
+    OUT last_rtt float8,
+    OUT consecutive_failures integer,
+    OUT phi float8,
+    OUT last_stream_time timestamp with time zone,
+    OUT decision_time timestamp with time zone,
+    OUT replay_lag bigint,
+    OUT replay_rate float8,
+    OUT last_beat_time timestamp with time zone,
+    OUT replication_latency float8,
+    OUT overruns bigint
+)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_promoter_paths(
+    OUT path integer,
+    OUT last_success_time timestamp with time zone,
+    OUT last_rtt float8,
+    OUT consecutive_failures integer
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_promoter_timeline(
+    OUT stage text,
+    OUT time timestamp with time zone,
+    OUT elapsed float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_promoter_latency(
+    OUT kind text,
+    OUT count bigint,
+    OUT mean float8,
+    OUT p50 float8,
+    OUT p99 float8,
+    OUT p999 float8,
+    OUT max float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_promoter_phases(
+    OUT phase text,
+    OUT count bigint,
+    OUT total float8,
+    OUT mean float8,
+    OUT max float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION pg_promoter_latency_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION pg_promoter_latency_reset() FROM PUBLIC;
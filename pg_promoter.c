@@ -9,28 +9,551 @@
 
 #include "postgres.h"
 
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/rmgr.h"
+#include "access/xlog.h"
+#include "access/xlog_internal.h"
+#include "access/xlogreader.h"
+#include "executor/spi.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqsignal.h"
+#include "nodes/pg_list.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+
 /* These are always necessary for a bgworker */
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
+#include "replication/message.h"
+#include "replication/walreceiver.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
 #include "storage/shmem.h"
+#include "storage/smgr.h"
+#include "storage/spin.h"
 
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
 #include "libpq-int.h"
 
 #define	HEARTBEAT_SQL "select 1;"
 
+/*
+ * Ask a peer standby whether its last heartbeat to primary server failed,
+ * and its position as a candidate for the election.
+ */
+#define	WITNESS_SQL \
+	"select s.consecutive_failures > 0, s.state," \
+	" pg_last_xlog_receive_location(), pg_last_xlog_replay_location()," \
+	" current_setting('pg_promoter.priority'), current_setting('cluster_name')" \
+	" from pg_promoter_status() s;"
+
+/* Ask the winner of the election whether it has been promoted */
+#define	WINNER_SQL "select not pg_is_in_recovery();"
+
+/* Channel which primary server notifies standbys on in notify mode */
+#define NOTIFY_CHANNEL	"pg_promoter"
+#define LISTEN_SQL		"listen " NOTIFY_CHANNEL ";"
+
+/* Prefix of logical messages which primary server embeds in WAL */
+#define WAL_MESSAGE_PREFIX	"pg_promoter"
+
+/* File to record the timeline of the last fail over, in $PGDATA */
+#define TIMELINE_FILENAME	"pg_promoter.timeline"
+
+/*
+ * Take a snapshot of hot blocks in shared buffers of primary server. This
+ * requires pg_buffercache on primary server. Blocks are sorted so that they
+ * are read sequentially.
+ */
+#define	PREWARM_SQL \
+	"select reldatabase, reltablespace, relfilenode, relforknumber, relblocknumber" \
+	" from (select * from pg_buffercache" \
+	"  where relfilenode is not null and usagecount >= 2" \
+	"  order by usagecount desc limit %d) s" \
+	" order by 1, 2, 3, 4, 5;"
+
+/* File to dump the snapshot of hot blocks, in $PGDATA */
+#define PREWARM_FILENAME	"pg_promoter.prewarm"
+
+/* Minimum interval to sample the replay rate in milliseconds */
+#define REPLAY_SAMPLE_INTERVAL	100
+
+/* Number of samples of the heartbeat table or WAL within their timeouts */
+#define LIVENESS_SAMPLES	4
+
+/* Maximum bytes of WAL to read for logical messages at once */
+#define WAL_MESSAGE_READ_LIMIT	(1024 * 1024)
+
+/* Interval to check the progress of promotion in milliseconds */
+#define PROMOTION_CHECK_INTERVAL	10
+
+/* Result of a heartbeat step */
+typedef enum HeartbeatResult
+{
+	HEARTBEAT_PENDING,			/* still in progress */
+	HEARTBEAT_SUCCEEDED,		/* primary server is alive */
+	HEARTBEAT_FAILED			/* could not get response */
+} HeartbeatResult;
+
+/* State of the query in progress */
+typedef enum ProbeState
+{
+	PROBE_IDLE,					/* waiting for next query */
+	PROBE_CONNECTING,			/* establishing connection */
+	PROBE_FLUSHING,				/* sending query */
+	PROBE_BUSY					/* waiting for the result */
+} ProbeState;
+
+/*
+ * Phases of a heartbeat. Note that libpq resolves host names within
+ * PQconnectStart(), so the time spent in it is regarded as DNS phase.
+ */
+typedef enum ProbePhase
+{
+	PROBE_PHASE_NONE = -1,
+	PROBE_PHASE_DNS,			/* resolving host name */
+	PROBE_PHASE_TCP,			/* establishing TCP connection */
+	PROBE_PHASE_TLS,			/* negotiating SSL */
+	PROBE_PHASE_AUTH,			/* authentication and backend startup */
+	PROBE_PHASE_QUERY			/* round trip of the query */
+} ProbePhase;
+
+#define NUM_PROBE_PHASES	(PROBE_PHASE_QUERY + 1)
+
+static const char *const ProbePhaseNames[] = {
+	"dns",
+	"tcp",
+	"tls",
+	"auth",
+	"query"
+};
+
+/* Result of confirmation by peer standbys */
+typedef enum ConfirmationResult
+{
+	CONFIRMATION_PENDING,		/* still waiting for peers */
+	CONFIRMATION_ACCEPTED,		/* quorum agreed that primary server is dead */
+	CONFIRMATION_REJECTED		/* quorum can't be reached any more */
+} ConfirmationResult;
+
+/*
+ * Position of a standby as a candidate for the election. The candidate which
+ * received the most WAL wins so that we don't lose any more transactions.
+ * Ties are broken by replayed WAL, priority and cluster_name in turn. Every
+ * standby must see the same order, so cluster_name must be unique among them;
+ * if candidates still tie, nobody is elected.
+ */
+typedef struct Candidate
+{
+	bool		answered;
+	bool		agrees;			/* primary server is unreachable from it */
+	bool		promoted;		/* it already decided to promote */
+	XLogRecPtr	received;
+	XLogRecPtr	replayed;
+	int			priority;		/* 0 means never to promote */
+	char		name[NAMEDATALEN];	/* cluster_name */
+} Candidate;
+
+/*
+ * Connection to a server which is driven asynchronously by the main loop.
+ * Primary server can be reached through several paths, each of which has
+ * its own connection. Peer standbys have their own connections as well.
+ * A NULL query means to establish the connection only.
+ */
+typedef struct ProbeConn
+{
+	char		name[NAMEDATALEN];	/* for messages */
+	char		conninfo[MAXPGPATH];
+	bool		is_heartbeat;		/* record latency of this connection? */
+	PGconn	   *conn;
+	ProbeState	state;
+	int			wait_events;		/* WL_SOCKET_* to wait for */
+	const char *query;				/* query in progress */
+	PGresult   *result;				/* result of the last query, if kept */
+	int64		start_usec;			/* when we started the query */
+	int64		query_start_usec;	/* when we sent the query */
+	ProbePhase	phase;				/* current phase */
+	int64		phase_start_usec;	/* when the current phase started */
+	int64		phase_usec[NUM_PROBE_PHASES];	/* time spent, or -1 */
+
+	pgsocket	tuned_sock;			/* socket tuneProbeSocket() was applied to */
+	int			nfailures;			/* consecutive failures to connect */
+	TimestampTz	next_connect_time;	/* don't redial in background until */
+	char		last_sqlstate[6];	/* of the last error reported while idle */
+	bool		notified;			/* got a notification since last round? */
+
+	/* Used only for heartbeats to the responder by UDP */
+	bool		udp;
+	pgsocket	sock;				/* PGINVALID_SOCKET if not opened */
+	struct sockaddr_storage addr;	/* address of the responder */
+	socklen_t	addrlen;
+	uint32		nonce;				/* random number for this standby */
+	uint64		seq;				/* sequence number of the last heartbeat */
+} ProbeConn;
+
+/* How heartbeats are sent to primary server */
+typedef enum ProbeMethod
+{
+	PROBE_METHOD_QUERY,			/* run HEARTBEAT_SQL */
+	PROBE_METHOD_UDP,			/* ask the responder by UDP */
+	PROBE_METHOD_NOTIFY			/* listen to notifications from primary */
+} ProbeMethod;
+
+static const struct config_enum_entry probe_method_options[] = {
+	{"query", PROBE_METHOD_QUERY, false},
+	{"udp", PROBE_METHOD_UDP, false},
+	{"notify", PROBE_METHOD_NOTIFY, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Heartbeat packet exchanged with the responder. The responder echoes the
+ * nonce and the sequence number back, so that standbys can ignore replies to
+ * other standbys or to earlier heartbeats. All fields are in network byte
+ * order.
+ */
+#define RESPONDER_REQUEST_MAGIC	"PPHQ"
+#define RESPONDER_REPLY_MAGIC	"PPHR"
+
+typedef struct HeartbeatPacket
+{
+	char		magic[4];
+	uint32		nonce;
+	uint32		seq_hi;
+	uint32		seq_lo;
+} HeartbeatPacket;
+
+/* Maximum number of sockets the responder listens on */
+#define MAX_RESPONDER_SOCKETS	8
+
+/* Maximum number of paths to primary server */
+#define MAX_PROBE_PATHS		8
+
+/* Maximum number of peer standbys */
+#define MAX_WITNESSES		8
+
+/* Maximum interval to redial unreachable peer standbys in milliseconds */
+#define MAX_REDIAL_INTERVAL	60000
+
+/* Failure detectors */
+typedef enum FailureDetector
+{
+	DETECTOR_COUNT,				/* keepalives_count consecutive failures */
+	DETECTOR_PHI				/* phi accrual failure detector */
+} FailureDetector;
+
+static const struct config_enum_entry detector_options[] = {
+	{"count", DETECTOR_COUNT, false},
+	{"phi", DETECTOR_PHI, false},
+	{NULL, 0, false}
+};
+
+/* What to do when fencing of primary server failed or timed out */
+typedef enum FencePolicy
+{
+	FENCE_POLICY_REQUIRED,		/* don't promote */
+	FENCE_POLICY_BEST_EFFORT	/* promote anyway */
+} FencePolicy;
+
+static const struct config_enum_entry fence_policy_options[] = {
+	{"required", FENCE_POLICY_REQUIRED, false},
+	{"best_effort", FENCE_POLICY_BEST_EFFORT, false},
+	{NULL, 0, false}
+};
+
+/*
+ * A shell command run in a child process with a deadline. Commands are run
+ * in parallel, each in its own process group so that the whole group can be
+ * killed on timeout.
+ */
+typedef struct ChildCommand
+{
+	const char *name;			/* for log messages */
+	const char *command;
+	pid_t		pid;			/* 0 if not running */
+	int			exitstatus;		/* as returned by waitpid() */
+	bool		timedout;
+	int64		start_usec;
+	int64		elapsed_usec;
+} ChildCommand;
+
+/*
+ * History of intervals between successful heartbeats in milliseconds, used
+ * by phi accrual failure detector.
+ */
+#define PHI_WINDOW_SIZE		100
+
+typedef struct ArrivalWindow
+{
+	double		intervals[PHI_WINDOW_SIZE];
+	int			nintervals;		/* number of valid entries */
+	int			next;			/* entry to be overwritten next */
+} ArrivalWindow;
+
+/* State of the worker, published in shared memory */
+typedef enum PromoterState
+{
+	PROMOTER_STATE_STARTING,	/* no heartbeat has completed yet */
+	PROMOTER_STATE_HEALTHY,		/* primary server responded last time */
+	PROMOTER_STATE_SUSPECT,		/* primary server didn't respond */
+	PROMOTER_STATE_CONFIRMING,	/* asking peer standbys */
+	PROMOTER_STATE_FOLLOWING,	/* waiting for a better peer to promote */
+	PROMOTER_STATE_PROMOTING,	/* decided to promote the standby server */
+	PROMOTER_STATE_PROMOTED		/* the standby server accepts writes */
+} PromoterState;
+
+static const char *const PromoterStateNames[] = {
+	"starting",
+	"healthy",
+	"suspect",
+	"confirming",
+	"following",
+	"promoting",
+	"promoted"
+};
+
+/* Stages of fail over, recorded in the timeline */
+typedef enum TimelineStage
+{
+	TIMELINE_FIRST_FAILURE,		/* first failed heartbeat */
+	TIMELINE_DECISION,			/* decided to promote */
+	TIMELINE_FENCED,			/* fencing of primary server finished */
+	TIMELINE_TRIGGER,			/* wrote the promote file */
+	TIMELINE_SIGNAL,			/* sent SIGUSR1 to postmaster */
+	TIMELINE_END_OF_RECOVERY,	/* startup process consumed the promote file */
+	TIMELINE_WRITABLE,			/* RecoveryInProgress() became false */
+	TIMELINE_POST_PROMOTE		/* post-promotion commands finished */
+} TimelineStage;
+
+#define NUM_TIMELINE_STAGES	(TIMELINE_POST_PROMOTE + 1)
+
+static const char *const TimelineStageNames[] = {
+	"first_failure",
+	"decision",
+	"fenced",
+	"trigger_file",
+	"signal",
+	"end_of_recovery",
+	"writable",
+	"post_promote"
+};
+
+/* Status of each path to primary server */
+typedef struct PathStatus
+{
+	TimestampTz	last_success_time;	/* end of the last successful heartbeat */
+	int64		last_rtt;			/* round trip of the last heartbeat in usec */
+	int			consecutive_failures;
+} PathStatus;
+
+/*
+ * Status of the worker. Only the worker writes this, so that the status is
+ * published with a change counter instead of a lock. Readers retry until they
+ * see an even counter which didn't change while copying the status, just like
+ * PgBackendStatus.
+ */
+typedef struct PromoterStatus
+{
+	int			pid;				/* pid of the worker, or 0 */
+	PromoterState state;
+	TimestampTz	last_probe_time;	/* start of the last heartbeat */
+	TimestampTz	last_success_time;	/* end of the last successful heartbeat */
+	int64		last_rtt;			/* round trip of the last heartbeat in usec */
+	int			consecutive_failures;
+	double		phi;				/* suspicion level of phi accrual detector */
+	TimestampTz	last_stream_time;	/* last message from walsender */
+	TimestampTz	decision_time;		/* when we decided to promote */
+	int64		replay_lag;			/* received but not replayed WAL in bytes */
+	double		replay_rate;		/* replayed WAL in bytes per second */
+	TimestampTz	last_beat_time;		/* replayed row of the heartbeat table */
+	int64		replication_latency;	/* from the write to our read in usec */
+	int64		overruns;			/* heartbeat slots missed */
+	TimestampTz	timeline[NUM_TIMELINE_STAGES];	/* 0 if not reached */
+	int			npaths;
+	PathStatus	paths[MAX_PROBE_PATHS];
+} PromoterStatus;
+
+/*
+ * Latency histogram of heartbeats. Latencies are recorded in microseconds
+ * into log-bucketed histogram like HdrHistogram: values less than
+ * LATENCY_SUB_BUCKETS have their own bucket, and each power of two range
+ * above it is split into LATENCY_SUB_BUCKETS / 2 linear buckets. So the
+ * relative error of a bucket is less than 2 / LATENCY_SUB_BUCKETS, and
+ * the histogram covers up to 2^(LATENCY_SUB_BUCKET_BITS + LATENCY_MAGNITUDES)
+ * microseconds with a fixed size. Counters are atomic so that backends can
+ * read or reset the histogram while the worker records to it.
+ */
+#define LATENCY_SUB_BUCKET_BITS		5
+#define LATENCY_SUB_BUCKETS			(1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_HALF_SUB_BUCKETS	(LATENCY_SUB_BUCKETS / 2)
+#define LATENCY_MAGNITUDES			32
+#define LATENCY_BUCKETS \
+	(LATENCY_SUB_BUCKETS + LATENCY_MAGNITUDES * LATENCY_HALF_SUB_BUCKETS)
+
+typedef enum LatencyKind
+{
+	LATENCY_CONNECT,			/* time to establish connection */
+	LATENCY_QUERY				/* round trip of heartbeat query */
+} LatencyKind;
+
+#define NUM_LATENCY_KINDS	(LATENCY_QUERY + 1)
+
+static const char *const LatencyKindNames[] = {
+	"connect",
+	"query"
+};
+
+typedef struct LatencyHistogram
+{
+	pg_atomic_uint64 count;
+	pg_atomic_uint64 sum;		/* in usec */
+	pg_atomic_uint64 max;		/* in usec */
+	pg_atomic_uint64 buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+/* Accumulated time of each phase of heartbeats */
+typedef struct PhaseCounters
+{
+	pg_atomic_uint64 count;
+	pg_atomic_uint64 sum;		/* in usec */
+	pg_atomic_uint64 max;		/* in usec */
+} PhaseCounters;
+
+typedef struct PromoterSharedState
+{
+	pg_atomic_uint32 changecount;
+	PromoterStatus status;
+
+	LatencyHistogram latency[NUM_LATENCY_KINDS];
+	PhaseCounters phases[NUM_PROBE_PHASES];
+} PromoterSharedState;
+
 PG_MODULE_MAGIC;
 
 void		_PG_init(void);
 void		PromoterMain(Datum);
+void		PromoterPrewarmMain(Datum);
+void		PromoterResponderMain(Datum);
+void		PromoterHeartbeatWriterMain(Datum);
 static void setupPromoter(void);
 static void doPromote(void);
-static bool heartbeatPrimaryServer(void);
+static List *appendListItem(List *list, StringInfo buf);
+static List *splitConninfoList(const char *value);
+static List *splitCommandList(const char *value);
+static void initProbe(ProbeConn *probe, const char *conninfo,
+					  bool is_heartbeat);
+static void disconnectProbe(ProbeConn *probe);
+static void closeProbeConnection(ProbeConn *probe);
+static HeartbeatResult startProbe(ProbeConn *probe, const char *query);
+static HeartbeatResult sendProbeQuery(ProbeConn *probe);
+static HeartbeatResult advanceProbe(ProbeConn *probe);
+static void tuneProbeSocket(ProbeConn *probe);
+static void probeNoticeReceiver(void *arg, const PGresult *res);
+static bool checkIdlePath(ProbeConn *path);
+static bool setupUdpProbe(ProbeConn *probe, int elevel);
+static bool resolveUdpProbe(ProbeConn *probe, int elevel);
+static pgsocket probeSocket(ProbeConn *probe);
+static HeartbeatResult sendUdpProbe(ProbeConn *probe);
+static HeartbeatResult receiveUdpProbe(ProbeConn *probe);
+static void answerHeartbeats(pgsocket sock);
+static HeartbeatResult startHeartbeat(void);
+static bool streamIsAlive(TimestampTz now);
+static bool heartbeatTableIsAlive(TimestampTz now);
+static void sampleHeartbeatTable(TimestampTz now);
+static bool lookupHeartbeatTable(void);
+static TimestampTz nextBeatTime(TimestampTz prev, int interval,
+								TimestampTz now);
+static void drainNotifies(ProbeConn *path);
+static bool walMessageIsAlive(TimestampTz now);
+static void readWalMessages(TimestampTz now);
+static int	walMessagePageRead(XLogReaderState *reader, XLogRecPtr targetPagePtr,
+							   int reqLen, XLogRecPtr targetRecPtr,
+							   char *readBuf, TimeLineID *pageTLI);
+static HeartbeatResult finishPath(int pathno, HeartbeatResult result);
+static void disconnectPrimaryServer(void);
+static void connectWitnesses(void);
+static void startConfirmation(void);
+static ConfirmationResult finishWitness(ProbeConn *witness,
+										HeartbeatResult result);
+static void cancelConfirmation(void);
+static int	compareCandidates(Candidate *a, Candidate *b);
+static int	electWinner(void);
+static void startFollowing(int winner, TimestampTz now);
+static bool finishFollowing(HeartbeatResult result);
+static void retargetPrimary(void);
+static void decidePromotion(TimestampTz now);
+static void waitForPromotion(void);
+static void recordTimeline(TimelineStage stage, TimestampTz time);
+static void writeTimelineFile(void);
+static bool fencePrimary(void);
+static void runPostPromoteCommands(void);
+static void runCommands(ChildCommand *commands, int ncommands, int timeout);
+static void sampleReplay(TimestampTz now);
+static int64 expectedCatchup(void);
+static void waitForCatchup(void);
+static void startPrewarmSnapshot(void);
+static void finishPrewarmSnapshot(HeartbeatResult result);
+static bool dumpPrewarmBlocks(PGresult *res);
+static long timeoutUntil(TimestampTz now, TimestampTz until);
+static void skipOverrunSlots(int64 now_usec);
+static int64 probeDeadline(ProbeConn *probe);
+static int	heartbeatInterval(void);
+static int	heartbeatTimeout(void);
+static void resetArrivalWindow(void);
+static void recordArrival(TimestampTz prev, TimestampTz now);
+static double computePhi(TimestampTz now);
+static bool failureSuspected(TimestampTz now);
+
+/* Functions for shared memory */
+static Size promoterShmemSize(void);
+static void promoterShmemStartup(void);
+static void publishStatus(void);
+static void readStatus(PromoterStatus *status);
+static int	latencyBucket(uint64 usec);
+static uint64 latencyBucketUpperBound(int bucket);
+static void recordLatency(LatencyKind kind, int64 usec);
+static void recordPhase(ProbePhase phase, int64 usec);
+static void updateMax(pg_atomic_uint64 *max, uint64 usec);
+static void resetLatency(void);
+static int64 elapsedUsec(TimestampTz start, TimestampTz stop);
+static int64 monotonicUsec(void);
+static ProbePhase phaseOfStatus(ConnStatusType status);
+static void switchPhase(ProbeConn *probe, ProbePhase phase);
+static void finishPhases(ProbeConn *probe);
+static Tuplestorestate *beginMaterializedSRF(FunctionCallInfo fcinfo,
+											 TupleDesc *tupdesc);
+
+PG_FUNCTION_INFO_V1(pg_promoter_status);
+PG_FUNCTION_INFO_V1(pg_promoter_paths);
+PG_FUNCTION_INFO_V1(pg_promoter_timeline);
+PG_FUNCTION_INFO_V1(pg_promoter_latency);
+PG_FUNCTION_INFO_V1(pg_promoter_phases);
+PG_FUNCTION_INFO_V1(pg_promoter_latency_reset);
 
 /* Function for signal handler */
 static void pg_promoter_sigterm(SIGNAL_ARGS);
@@ -43,13 +566,92 @@ static volatile sig_atomic_t got_sigterm = false;
 /* GUC variables */
 static int	promoter_keepalives_time;
 static int	promoter_keepalives_count;
+static int	promoter_heartbeat_interval;
+static int	promoter_heartbeat_timeout;
+static int	promoter_failover_timeout;
 static char	*promoter_primary_conninfo = NULL;
+static bool	promoter_keep_connection = true;
+static char	*promoter_witness_conninfo = NULL;
+static int	promoter_witness_quorum;
+static int	promoter_witness_timeout;
+static bool	promoter_election = false;
+static int	promoter_priority;
+static int	promoter_election_timeout;
+static int	promoter_walreceiver_timeout;
+static int	promoter_catchup_timeout;
+static int	promoter_connect_timeout;
+static int	promoter_tcp_keepalives_idle;
+static int	promoter_tcp_keepalives_interval;
+static int	promoter_tcp_keepalives_count;
+static int	promoter_tcp_user_timeout;
+static int	promoter_query_timeout;
+static char	*promoter_database = NULL;
+static int	promoter_heartbeat_table_interval;
+static int	promoter_heartbeat_table_timeout;
+static int	promoter_notify_interval;
+static int	promoter_wal_message_interval;
+static int	promoter_wal_message_timeout;
+static int	promoter_probe_method = PROBE_METHOD_QUERY;
+static int	promoter_responder_port;
+static char	*promoter_fence_command = NULL;
+static int	promoter_fence_timeout;
+static int	promoter_fence_policy = FENCE_POLICY_REQUIRED;
+static char	*promoter_post_promote_command = NULL;
+static int	promoter_post_promote_timeout;
+static int	promoter_prewarm_interval;
+static int	promoter_prewarm_blocks;
+static int	promoter_failure_detector = DETECTOR_COUNT;
+static double promoter_phi_threshold;
+static int	promoter_phi_min_stddev;
 
 /* Variables for connections */
-static char conninfo[MAXPGPATH];
+static ProbeConn probe_paths[MAX_PROBE_PATHS];
+static int	nprobe_paths;
+
+/* Variables for the heartbeat in progress */
+static int	npending_paths;			/* paths which haven't responded yet */
+static bool	round_succeeded;		/* did any path succeed? */
+static TimestampTz probe_start_time;
+static bool	connection_lost = false;	/* kept connection was closed */
+static int64 probe_slot_usec;		/* slot of the heartbeat in progress */
+static int64 next_probe_usec;		/* next slot on the monotonic clock */
+
+/* Variables for tracking the replay */
+static XLogRecPtr last_replay_lsn = InvalidXLogRecPtr;
+static TimestampTz last_replay_sample_time = 0;
+static int64 expected_catchup = -1;	/* at the trigger in usec, -1 if unknown */
+
+/* Variables for pre-warming buffers */
+static ProbeConn prewarm_probe;
+static char prewarm_query[512];
+static TimestampTz next_prewarm_time;
+static BackgroundWorkerHandle *prewarm_worker = NULL;
+
+/* Variables for confirmation by peer standbys */
+static ProbeConn witnesses[MAX_WITNESSES];
+static int	nwitnesses;
+static bool	confirming;				/* confirmation in progress? */
+static int	npending_witnesses;		/* peers which haven't answered yet */
+static int	nagreed_witnesses;		/* peers which agreed */
+static TimestampTz confirm_start_time;
+static TimestampTz next_confirm_time;
+static Candidate candidates[MAX_WITNESSES];
+
+/* Variables for following the winner of the election */
+static bool	following;				/* waiting for the winner to promote? */
+static int	winner_index;			/* index of the winner in witnesses */
+static TimestampTz follow_end_time;
+static TimestampTz next_winner_check_time;
+static TimestampTz last_success_time;
 
 /* Variables for cluster management */
 static int retry_count;
+static ArrivalWindow arrival_window;
+
+/* Variables for shared memory */
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static PromoterSharedState *promoter_shared = NULL;
+static PromoterStatus my_status;
 
 typedef struct worktable
 {
@@ -57,6 +659,25 @@ typedef struct worktable
 	const char *name;
 } worktable;
 
+/* The heartbeat table, in the schema of pg_promoter extension */
+static worktable heartbeat_table = {NULL, "pg_promoter_heartbeat"};
+static TimestampTz last_table_beat_time = 0;	/* beat_time we saw last */
+static TimestampTz last_beat_sample_time = 0;	/* when we read it last */
+static TimestampTz next_beat_sample_time = 0;
+static TimestampTz last_beat_change_time = 0;	/* it changed after this */
+static bool heartbeat_table_missing = false;	/* already logged so? */
+
+/* Variables for reading logical messages in WAL */
+static XLogReaderState *wal_reader = NULL;
+static XLogRecPtr wal_read_ptr = InvalidXLogRecPtr;	/* next record to read */
+static int	wal_read_fd = -1;
+static XLogSegNo wal_read_segno = 0;
+static TimestampTz last_wal_message_time = 0;	/* arrived after this */
+static TimestampTz wal_caught_up_time = 0;	/* read all received WAL */
+static TimestampTz next_wal_read_time = 0;
+static bool	wal_read_behind = false;	/* hit WAL_MESSAGE_READ_LIMIT? */
+static bool	wal_read_failed = false;	/* couldn't read a page? */
+
 
 /*
  * Signal handler for SIGTERM
@@ -89,196 +710,4295 @@ pg_promoter_sighup(SIGNAL_ARGS)
 }
 
 /*
- * Set up several parameters for a worker process
+ * Estimate shared memory space needed.
+ */
+static Size
+promoterShmemSize(void)
+{
+	return MAXALIGN(sizeof(PromoterSharedState));
+}
+
+/*
+ * shmem_startup hook: allocate or attach to shared memory.
  */
 static void
-setupPromoter(void)
+promoterShmemStartup(void)
 {
-	PGconn *con;
+	bool		found;
 
-	/* Set up variables */
-	snprintf(conninfo, MAXPGPATH, "%s", promoter_primary_conninfo);
-	retry_count = 0;
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
 
-	/* Connection confirm */
-	if(!(con = PQconnectdb(conninfo)))
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	promoter_shared = ShmemInitStruct("pg_promoter",
+									  promoterShmemSize(),
+									  &found);
+	if (!found)
 	{
-		ereport(LOG,
-				(errmsg("could not establish connection to primary server : %s", conninfo)));
-		proc_exit(1);
+		int			i;
+		int			j;
+
+		memset(promoter_shared, 0, promoterShmemSize());
+		pg_atomic_init_u32(&promoter_shared->changecount, 0);
+
+		for (i = 0; i < NUM_LATENCY_KINDS; i++)
+		{
+			LatencyHistogram *hist = &promoter_shared->latency[i];
+
+			pg_atomic_init_u64(&hist->count, 0);
+			pg_atomic_init_u64(&hist->sum, 0);
+			pg_atomic_init_u64(&hist->max, 0);
+			for (j = 0; j < LATENCY_BUCKETS; j++)
+				pg_atomic_init_u64(&hist->buckets[j], 0);
+		}
+
+		for (i = 0; i < NUM_PROBE_PHASES; i++)
+		{
+			PhaseCounters *counters = &promoter_shared->phases[i];
+
+			pg_atomic_init_u64(&counters->count, 0);
+			pg_atomic_init_u64(&counters->sum, 0);
+			pg_atomic_init_u64(&counters->max, 0);
+		}
 	}
 
-	PQfinish(con);
-	return;
+	LWLockRelease(AddinShmemInitLock);
 }
 
 /*
- * headbeatPrimaryServer()
+ * publishStatus()
  *
- * This fucntion does heatbeating to primary server. If could not establish connection
- * to primary server, or primary server didn't reaction, return false.
+ * Copy my_status into shared memory. The change counter is odd while we're
+ * writing, so that readers can detect a torn copy.
  */
-static bool
-heartbeatPrimaryServer(void)
+static void
+publishStatus(void)
 {
-	PGconn		*con;
-	PGresult 	*res;
+	if (promoter_shared == NULL)
+		return;
 
-	/* Try to connect to primary server */
-	if ((con = PQconnectdb(conninfo)) == NULL)
+	pg_atomic_fetch_add_u32(&promoter_shared->changecount, 1);
+	pg_write_barrier();
+	memcpy(&promoter_shared->status, &my_status, sizeof(PromoterStatus));
+	pg_write_barrier();
+	pg_atomic_fetch_add_u32(&promoter_shared->changecount, 1);
+}
+
+/*
+ * readStatus()
+ *
+ * Copy the status published by the worker without taking any lock.
+ */
+static void
+readStatus(PromoterStatus *status)
+{
+	for (;;)
 	{
-		ereport(LOG,
-				(errmsg("Could not establish conenction to primary server at %d time(s)",
-						(retry_count + 1))));
-		PQfinish(con);
-		return false;
+		uint32		before;
+		uint32		after;
+
+		before = pg_atomic_read_u32(&promoter_shared->changecount);
+		pg_read_barrier();
+		memcpy(status, &promoter_shared->status, sizeof(PromoterStatus));
+		pg_read_barrier();
+		after = pg_atomic_read_u32(&promoter_shared->changecount);
+
+		if (before == after && (before & 1) == 0)
+			break;
+
+		/* Make sure we can break out of loop if stuck... */
+		CHECK_FOR_INTERRUPTS();
 	}
+}
+
+/*
+ * latencyBucket()
+ *
+ * Return the histogram bucket for the latency in microseconds.
+ */
+static int
+latencyBucket(uint64 usec)
+{
+	int			magnitude = 0;
 
-	res = PQexec(con, HEARTBEAT_SQL);
+	if (usec < LATENCY_SUB_BUCKETS)
+		return (int) usec;
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	/* Shift the value until it fits in the upper half of sub buckets */
+	while (usec >= LATENCY_SUB_BUCKETS)
 	{
-		/* Failed to ping to master server, report the number of retrying */
-		ereport(LOG,
-				(errmsg("could not get tuple from primary server at %d time(s)",
-						(retry_count + 1))));
-		PQfinish(con);
-		return false;
+		usec >>= 1;
+		magnitude++;
 	}
 
-	/* Primary server is alive now */
-	PQfinish(con);
-	return true;
+	/* Latencies out of the range go to the last bucket */
+	if (magnitude > LATENCY_MAGNITUDES)
+		return LATENCY_BUCKETS - 1;
+
+	return LATENCY_SUB_BUCKETS + (magnitude - 1) * LATENCY_HALF_SUB_BUCKETS +
+		(int) (usec - LATENCY_HALF_SUB_BUCKETS);
 }
 
 /*
- * Main routine of pg_promoter.
+ * latencyBucketUpperBound()
+ *
+ * Return the highest latency in microseconds that falls into the bucket.
  */
-void
-PromoterMain(Datum main_arg)
+static uint64
+latencyBucketUpperBound(int bucket)
 {
-	setupPromoter();
-		
-	/* Establish signal handlers before unblocking signals */
-	pqsignal(SIGHUP, pg_promoter_sighup);
-	pqsignal(SIGTERM, pg_promoter_sigterm);
-	
-	/* We're now ready to receive signals */
-	BackgroundWorkerUnblockSignals();
+	int			magnitude;
+	uint64		sub;
 
-	/*
-	 * Main loop: do this until the SIGTERM handler tells us to terminate
-	 */
-	while (!got_sigterm)
-	{
-		int		rc;
+	if (bucket < LATENCY_SUB_BUCKETS)
+		return (uint64) bucket;
 
-		/*
-		 * Background workers mustn't call usleep() or any direct equivalent:
-		 * instead, they may wait on their process latch, which sleeps as
-		 * necessary, but is awakened if postmaster dies.  That way the
-		 * background process goes away immediately in an emergency.
-		 */
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   promoter_keepalives_time * 1000L);
-		ResetLatch(&MyProc->procLatch);
+	magnitude = (bucket - LATENCY_SUB_BUCKETS) / LATENCY_HALF_SUB_BUCKETS + 1;
+	sub = (bucket - LATENCY_SUB_BUCKETS) % LATENCY_HALF_SUB_BUCKETS +
+		LATENCY_HALF_SUB_BUCKETS;
 
-		/* Emergency bailout if postmaster has died */
-		if (rc & WL_POSTMASTER_DEATH)
-			proc_exit(1);
+	return ((sub + 1) << magnitude) - 1;
+}
 
-		/* If got SIGHUP, reload the configuration file */
-		if (got_sighup)
-		{
-			got_sighup = false;
-			ProcessConfigFile(PGC_SIGHUP);
-		}
+/*
+ * elapsedUsec()
+ *
+ * Return the time between two timestamps in microseconds.
+ */
+static int64
+elapsedUsec(TimestampTz start, TimestampTz stop)
+{
+	long		secs;
+	int			usecs;
 
-		/*
-		 * Do heartbeat connection to master server. If heartbeat is failed,
-		 * increment retry_count..
-		 */
-		if (!heartbeatPrimaryServer())
-			retry_count++;
+	TimestampDifference(start, stop, &secs, &usecs);
 
-		/* If retry_count is reached to promoter_keepalives_count,
-		 * do promote the standby server to master server, and exit.
-		 */
-		if (retry_count >= promoter_keepalives_count)
-		{
-			doPromote();
-			proc_exit(0);
-		}
-	}
+	return (int64) secs * USECS_PER_SEC + usecs;
+}
 
-	proc_exit(1);
+/*
+ * monotonicUsec()
+ *
+ * Return the current time of the monotonic clock in microseconds, which is
+ * not affected by adjustment of the system clock. This is used to measure
+ * durations.
+ */
+static int64
+monotonicUsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64) ts.tv_sec * USECS_PER_SEC + ts.tv_nsec / 1000;
 }
 
 /*
- * doPromote()
+ * updateMax()
  *
- * Promote standby server using ordinally way which is used by
- * pg_ctl client tool. Put trigger file into $PGDATA, and send
- * SIGUSR1 signal to standby server.
+ * Raise the maximum in shared memory to usec. Loop in case it is reset
+ * concurrently.
  */
 static void
-doPromote(void)
+updateMax(pg_atomic_uint64 *max, uint64 usec)
 {
-	char trigger_filepath[MAXPGPATH];
-	FILE *fp;
+	uint64		cur = pg_atomic_read_u64(max);
 
-    snprintf(trigger_filepath, 1000, "%s/promote", DataDir);
-
-	if ((fp = fopen(trigger_filepath, "w")) == NULL)
+	while (usec > cur)
 	{
-		ereport(LOG,
-				(errmsg("could not create promote file: \"%s\"", trigger_filepath)));
-		proc_exit(1);
+		if (pg_atomic_compare_exchange_u64(max, &cur, usec))
+			break;
 	}
+}
 
-	if (fclose(fp))
-	{
-		ereport(LOG,
-				(errmsg("could not close promote file: \"%s\"", trigger_filepath)));
-		proc_exit(1);
-	}
+/*
+ * recordLatency()
+ *
+ * Add a latency sample to the histogram in shared memory.
+ */
+static void
+recordLatency(LatencyKind kind, int64 usec)
+{
+	LatencyHistogram *hist;
 
-	ereport(LOG,
-			(errmsg("promote standby server to primary server")));
+	if (promoter_shared == NULL)
+		return;
 
-	/* Do promote */
-	if (kill(PostmasterPid, SIGUSR1) != 0)
-	{
-		ereport(LOG,
-				(errmsg("failed to send SIGUSR1 signal to postmaster process : %d",
-						PostmasterPid)));
-		proc_exit(1);
-	}
+	hist = &promoter_shared->latency[kind];
+
+	pg_atomic_fetch_add_u64(&hist->buckets[latencyBucket((uint64) usec)], 1);
+	pg_atomic_fetch_add_u64(&hist->count, 1);
+	pg_atomic_fetch_add_u64(&hist->sum, (uint64) usec);
+	updateMax(&hist->max, (uint64) usec);
 }
 
 /*
- * Entrypoint of this module.
+ * recordPhase()
  *
- * We register more than one worker process here, to demonstrate how that can
- * be done.
+ * Add the time spent in a phase of heartbeat to the counters in shared
+ * memory.
  */
-void
-_PG_init(void)
+static void
+recordPhase(ProbePhase phase, int64 usec)
 {
-	BackgroundWorker worker;
+	PhaseCounters *counters;
 
-	if (!process_shared_preload_libraries_in_progress)
+	if (promoter_shared == NULL)
 		return;
 
-	/* get the configuration */
-	DefineCustomIntVariable("pg_promoter.keepalives_time",
-							"Specific time between polling to primary server",
-							NULL,
-							&promoter_keepalives_time,
-							5,
+	counters = &promoter_shared->phases[phase];
+
+	pg_atomic_fetch_add_u64(&counters->count, 1);
+	pg_atomic_fetch_add_u64(&counters->sum, (uint64) usec);
+	updateMax(&counters->max, (uint64) usec);
+}
+
+/*
+ * resetLatency()
+ *
+ * Clear all latency histograms and phase counters.
+ */
+static void
+resetLatency(void)
+{
+	int			i;
+	int			j;
+
+	for (i = 0; i < NUM_PROBE_PHASES; i++)
+	{
+		PhaseCounters *counters = &promoter_shared->phases[i];
+
+		pg_atomic_write_u64(&counters->count, 0);
+		pg_atomic_write_u64(&counters->sum, 0);
+		pg_atomic_write_u64(&counters->max, 0);
+	}
+
+	for (i = 0; i < NUM_LATENCY_KINDS; i++)
+	{
+		LatencyHistogram *hist = &promoter_shared->latency[i];
+
+		pg_atomic_write_u64(&hist->count, 0);
+		pg_atomic_write_u64(&hist->sum, 0);
+		pg_atomic_write_u64(&hist->max, 0);
+		for (j = 0; j < LATENCY_BUCKETS; j++)
+			pg_atomic_write_u64(&hist->buckets[j], 0);
+	}
+}
+
+/*
+ * appendListItem()
+ *
+ * Append the item accumulated in buf to the list, trimming surrounding
+ * whitespaces and ignoring empty items, and reset buf for the next one.
+ */
+static List *
+appendListItem(List *list, StringInfo buf)
+{
+	char	   *item = buf->data;
+	int			len;
+
+	while (isspace((unsigned char) *item))
+		item++;
+	len = strlen(item);
+	while (len > 0 && isspace((unsigned char) item[len - 1]))
+		item[--len] = '\0';
+	if (len > 0)
+		list = lappend(list, pstrdup(item));
+
+	resetStringInfo(buf);
+
+	return list;
+}
+
+/*
+ * splitConninfoList()
+ *
+ * Split the list of connection strings separated by semicolons, and return
+ * a List of palloc'd strings. Semicolons within single quotes are not
+ * regarded as separators, so that quoted values can contain them.
+ */
+static List *
+splitConninfoList(const char *value)
+{
+	List	   *result = NIL;
+	StringInfoData buf;
+	bool		in_quote = false;
+	const char *p;
+
+	initStringInfo(&buf);
+
+	for (p = value;; p++)
+	{
+		if (*p == '\0' || (*p == ';' && !in_quote))
+		{
+			result = appendListItem(result, &buf);
+
+			if (*p == '\0')
+				break;
+			continue;
+		}
+
+		if (*p == '\\' && in_quote && p[1] != '\0')
+			appendStringInfoChar(&buf, *p++);
+		else if (*p == '\'')
+			in_quote = !in_quote;
+
+		appendStringInfoChar(&buf, *p);
+	}
+
+	pfree(buf.data);
+
+	return result;
+}
+
+/*
+ * splitCommandList()
+ *
+ * Split the list of shell commands separated by commas, like other list
+ * parameters, and return a List of palloc'd strings. Shell uses semicolons
+ * by itself, so commands can't be separated like conninfos. A command
+ * containing commas must be double-quoted, and a double quote within it is
+ * written twice. Unlike SplitIdentifierString(), commands are neither
+ * downcased nor truncated.
+ */
+static List *
+splitCommandList(const char *value)
+{
+	List	   *result = NIL;
+	StringInfoData buf;
+	bool		in_quote = false;
+	const char *p;
+
+	initStringInfo(&buf);
+
+	for (p = value;; p++)
+	{
+		if (*p == '\0' || (*p == ',' && !in_quote))
+		{
+			result = appendListItem(result, &buf);
+
+			if (*p == '\0')
+				break;
+			continue;
+		}
+
+		/* Quotes are removed, except doubled ones within quotes */
+		if (*p == '"')
+		{
+			if (!in_quote || p[1] != '"')
+			{
+				in_quote = !in_quote;
+				continue;
+			}
+			p++;
+		}
+
+		appendStringInfoChar(&buf, *p);
+	}
+
+	pfree(buf.data);
+
+	return result;
+}
+
+/*
+ * Set up several parameters for a worker process
+ */
+static void
+setupPromoter(void)
+{
+	List	   *conninfos;
+	List	   *witness_conninfos;
+	ListCell   *lc;
+
+	/* Set up paths to primary server */
+	conninfos = splitConninfoList(promoter_primary_conninfo);
+
+	if (list_length(conninfos) > MAX_PROBE_PATHS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("too many paths in pg_promoter.primary_conninfo"),
+				 errdetail("At most %d paths can be specified.",
+						   MAX_PROBE_PATHS)));
+
+	/* Even empty conninfo means one path, which uses libpq's defaults */
+	if (conninfos == NIL)
+		conninfos = lappend(conninfos, pstrdup(""));
+
+	/* Set up peer standbys */
+	witness_conninfos = splitConninfoList(promoter_witness_conninfo);
+
+	if (list_length(witness_conninfos) > MAX_WITNESSES)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("too many peers in pg_promoter.witness_conninfo"),
+				 errdetail("At most %d peers can be specified.",
+						   MAX_WITNESSES)));
+
+	nwitnesses = 0;
+	foreach(lc, witness_conninfos)
+	{
+		ProbeConn  *witness = &witnesses[nwitnesses++];
+
+		initProbe(witness, (char *) lfirst(lc), false);
+		snprintf(witness->name, NAMEDATALEN, "peer server %d", nwitnesses);
+	}
+	confirming = false;
+	following = false;
+
+	/* Ties of the election are broken by cluster_name at last */
+	if (promoter_election && cluster_name[0] == '\0')
+		ereport(LOG,
+				(errmsg("cluster_name is not set though pg_promoter.election is enabled"),
+				 errdetail("Standby servers in the same position can't be told apart, and none of them will promote.")));
+
+	nprobe_paths = 0;
+	foreach(lc, conninfos)
+	{
+		ProbeConn  *path = &probe_paths[nprobe_paths++];
+
+		initProbe(path, (char *) lfirst(lc), true);
+		snprintf(path->name, NAMEDATALEN, "primary server via path %d",
+				 nprobe_paths);
+		if (promoter_probe_method == PROBE_METHOD_UDP)
+			setupUdpProbe(path, ERROR);
+	}
+
+	/*
+	 * Snapshots of hot blocks are taken through the first path, but using
+	 * its own connection so that a large result doesn't delay heartbeats.
+	 */
+	initProbe(&prewarm_probe, probe_paths[0].conninfo, false);
+	snprintf(prewarm_probe.name, NAMEDATALEN, "primary server for prewarm");
+
+	/* Set up variables */
+	retry_count = 0;
+	npending_paths = 0;
+	round_succeeded = false;
+
+	memset(&my_status, 0, sizeof(PromoterStatus));
+	my_status.pid = MyProcPid;
+	my_status.state = PROMOTER_STATE_STARTING;
+	my_status.npaths = nprobe_paths;
+	publishStatus();
+
+	/*
+	 * We don't confirm the connection here because it would block. The
+	 * first heartbeat tells us whether primary server is reachable.
+	 */
+	resetArrivalWindow();
+
+	last_success_time = GetCurrentTimestamp();
+	next_probe_usec = monotonicUsec() + (int64) heartbeatInterval() * 1000;
+	return;
+}
+
+/*
+ * initProbe()
+ *
+ * Initialize the connection to the server. No connection is established
+ * until the first query.
+ */
+static void
+initProbe(ProbeConn *probe, const char *conninfo, bool is_heartbeat)
+{
+	int			i;
+
+	memset(probe, 0, sizeof(ProbeConn));
+	snprintf(probe->conninfo, MAXPGPATH, "%s", conninfo);
+	probe->is_heartbeat = is_heartbeat;
+	probe->state = PROBE_IDLE;
+	probe->phase = PROBE_PHASE_NONE;
+	for (i = 0; i < NUM_PROBE_PHASES; i++)
+		probe->phase_usec[i] = -1;
+	probe->sock = PGINVALID_SOCKET;
+	probe->tuned_sock = PGINVALID_SOCKET;
+}
+
+/*
+ * phaseOfStatus()
+ *
+ * Return the phase of heartbeat that the connection status belongs to.
+ */
+static ProbePhase
+phaseOfStatus(ConnStatusType status)
+{
+	switch (status)
+	{
+		case CONNECTION_STARTED:
+		case CONNECTION_MADE:
+			return PROBE_PHASE_TCP;
+		case CONNECTION_SSL_STARTUP:
+			return PROBE_PHASE_TLS;
+		case CONNECTION_OK:
+		case CONNECTION_BAD:
+			return PROBE_PHASE_NONE;
+		default:
+			return PROBE_PHASE_AUTH;
+	}
+}
+
+/*
+ * switchPhase()
+ *
+ * Move to the given phase, adding the time spent in the current phase.
+ */
+static void
+switchPhase(ProbeConn *probe, ProbePhase phase)
+{
+	int64		now;
+
+	if (probe->phase == phase)
+		return;
+
+	now = monotonicUsec();
+
+	if (probe->phase != PROBE_PHASE_NONE)
+	{
+		if (probe->phase_usec[probe->phase] < 0)
+			probe->phase_usec[probe->phase] = 0;
+		probe->phase_usec[probe->phase] += now - probe->phase_start_usec;
+	}
+
+	probe->phase = phase;
+	probe->phase_start_usec = now;
+}
+
+/*
+ * finishPhases()
+ *
+ * Close the current phase, and record the time spent in each phase of the
+ * heartbeat. Phases of failed heartbeats are recorded as well, so that we
+ * can see where heartbeats got stuck.
+ */
+static void
+finishPhases(ProbeConn *probe)
+{
+	int			i;
+
+	switchPhase(probe, PROBE_PHASE_NONE);
+
+	for (i = 0; i < NUM_PROBE_PHASES; i++)
+	{
+		if (probe->is_heartbeat && probe->phase_usec[i] >= 0)
+			recordPhase((ProbePhase) i, probe->phase_usec[i]);
+		probe->phase_usec[i] = -1;
+	}
+}
+
+/*
+ * disconnectProbe()
+ *
+ * Close the connection if any, and forget the query in progress.
+ */
+static void
+disconnectProbe(ProbeConn *probe)
+{
+	finishPhases(probe);
+
+	if (probe->conn != NULL)
+		PQfinish(probe->conn);
+	if (probe->result != NULL)
+		PQclear(probe->result);
+	if (probe->sock != PGINVALID_SOCKET)
+		closesocket(probe->sock);
+	probe->sock = PGINVALID_SOCKET;
+	probe->tuned_sock = PGINVALID_SOCKET;
+	probe->conn = NULL;
+	probe->result = NULL;
+	probe->state = PROBE_IDLE;
+}
+
+/*
+ * closeProbeConnection()
+ *
+ * Close the connection after a successful query. Unlike disconnectProbe(),
+ * the result is kept, since the caller hasn't looked at the answer of peer
+ * standbys yet.
+ */
+static void
+closeProbeConnection(ProbeConn *probe)
+{
+	PQfinish(probe->conn);
+	probe->conn = NULL;
+	probe->tuned_sock = PGINVALID_SOCKET;
+}
+
+/*
+ * startProbe()
+ *
+ * Start sending the query to the server. If pg_promoter.keep_connection is
+ * enabled, the connection established by previous query is reused as long
+ * as it is still healthy, so that each heartbeat costs only one round trip.
+ * Otherwise start establishing a new connection without blocking.
+ */
+static HeartbeatResult
+startProbe(ProbeConn *probe, const char *query)
+{
+	probe->start_usec = monotonicUsec();
+	probe->query = query;
+
+	if (probe->result != NULL)
+		PQclear(probe->result);
+	probe->result = NULL;
+
+	if (probe->udp)
+		return sendUdpProbe(probe);
+
+	/* Reuse the established connection if possible */
+	if (probe->conn != NULL)
+	{
+		if (PQstatus(probe->conn) == CONNECTION_OK)
+		{
+			if (query == NULL)
+				return HEARTBEAT_SUCCEEDED;
+			return sendProbeQuery(probe);
+		}
+
+		disconnectProbe(probe);
+	}
+
+	switchPhase(probe, PROBE_PHASE_DNS);
+	probe->conn = PQconnectStart(probe->conninfo);
+
+	if (probe->conn == NULL || PQstatus(probe->conn) == CONNECTION_BAD)
+	{
+		ereport(LOG,
+				(errmsg("could not establish connection to %s: %s",
+						probe->name, PQerrorMessage(probe->conn))));
+		disconnectProbe(probe);
+		return HEARTBEAT_FAILED;
+	}
+
+	switchPhase(probe, phaseOfStatus(PQstatus(probe->conn)));
+	tuneProbeSocket(probe);
+
+	/* Errors reported while idle are passed as notices */
+	probe->last_sqlstate[0] = '\0';
+	if (probe->is_heartbeat)
+		PQsetNoticeReceiver(probe->conn, probeNoticeReceiver, probe);
+
+	/* Per libpq's document, behave as if PQconnectPoll returned WRITING */
+	probe->state = PROBE_CONNECTING;
+	probe->wait_events = WL_SOCKET_WRITEABLE;
+	return HEARTBEAT_PENDING;
+}
+
+/*
+ * tuneProbeSocket()
+ *
+ * Apply TCP keepalive and TCP_USER_TIMEOUT settings to the socket of the
+ * connection, so that a dead peer of a long-lived connection is noticed as a
+ * socket error within seconds rather than the system default of two hours.
+ * libpq may open another socket while trying the next address, so this is
+ * called whenever the connection advances. We set them by ourselves rather
+ * than through conninfo, which may be a URI and whose libpq may not know
+ * tcp_user_timeout.
+ */
+static void
+tuneProbeSocket(ProbeConn *probe)
+{
+	pgsocket	sock = PQsocket(probe->conn);
+	struct sockaddr_storage addr;
+	socklen_t	addrlen = sizeof(addr);
+
+	if (sock == PGINVALID_SOCKET || sock == probe->tuned_sock)
+		return;
+	probe->tuned_sock = sock;
+
+	/* Nothing to do for Unix-domain sockets */
+	if (getsockname(sock, (struct sockaddr *) &addr, &addrlen) < 0 ||
+		addr.ss_family == AF_UNIX)
+		return;
+
+#ifdef TCP_KEEPIDLE
+	if (promoter_tcp_keepalives_idle > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE,
+				   (char *) &promoter_tcp_keepalives_idle, sizeof(int)) < 0)
+		ereport(LOG,
+				(errmsg("could not set TCP_KEEPIDLE for %s: %m", probe->name)));
+#endif
+#ifdef TCP_KEEPINTVL
+	if (promoter_tcp_keepalives_interval > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+				   (char *) &promoter_tcp_keepalives_interval, sizeof(int)) < 0)
+		ereport(LOG,
+				(errmsg("could not set TCP_KEEPINTVL for %s: %m", probe->name)));
+#endif
+#ifdef TCP_KEEPCNT
+	if (promoter_tcp_keepalives_count > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT,
+				   (char *) &promoter_tcp_keepalives_count, sizeof(int)) < 0)
+		ereport(LOG,
+				(errmsg("could not set TCP_KEEPCNT for %s: %m", probe->name)));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	if (promoter_tcp_user_timeout > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT,
+				   (char *) &promoter_tcp_user_timeout, sizeof(int)) < 0)
+		ereport(LOG,
+				(errmsg("could not set TCP_USER_TIMEOUT for %s: %m", probe->name)));
+#endif
+}
+
+/*
+ * probeNoticeReceiver()
+ *
+ * Remember SQLSTATE of errors from the server. libpq passes an error which
+ * arrives while no query is in progress, e.g. FATAL on shutdown of the
+ * server, to the notice receiver.
+ */
+static void
+probeNoticeReceiver(void *arg, const PGresult *res)
+{
+	ProbeConn  *probe = (ProbeConn *) arg;
+	const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	const char *severity = PQresultErrorField(res, PG_DIAG_SEVERITY);
+
+	if (sqlstate == NULL || severity == NULL ||
+		(strcmp(severity, "FATAL") != 0 && strcmp(severity, "PANIC") != 0))
+		return;
+
+	strlcpy(probe->last_sqlstate, sqlstate, sizeof(probe->last_sqlstate));
+}
+
+/*
+ * checkIdlePath()
+ *
+ * Read what arrived on the kept connection through the path while no
+ * heartbeat is in progress. Return false if the connection has been lost,
+ * after logging why. Clean or fast shutdown of primary server sends FATAL
+ * admin_shutdown (57P01) and closes the connection, so that we can notice it
+ * within milliseconds instead of waiting for the next heartbeat.
+ */
+static bool
+checkIdlePath(ProbeConn *path)
+{
+	if (PQconsumeInput(path->conn) && PQstatus(path->conn) == CONNECTION_OK)
+	{
+		drainNotifies(path);
+		return true;
+	}
+
+	if (strcmp(path->last_sqlstate, "57P01") == 0)
+		ereport(LOG,
+				(errmsg("%s is shutting down", path->name)));
+	else if (strcmp(path->last_sqlstate, "57P02") == 0)
+		ereport(LOG,
+				(errmsg("%s is shutting down due to crash of another process",
+						path->name)));
+	else if (path->last_sqlstate[0] != '\0')
+		ereport(LOG,
+				(errmsg("%s terminated the connection with SQLSTATE %s",
+						path->name, path->last_sqlstate)));
+	else
+		ereport(LOG,
+				(errmsg("%s closed the connection unexpectedly: %s",
+						path->name, PQerrorMessage(path->conn))));
+
+	disconnectProbe(path);
+	return false;
+}
+
+/*
+ * drainNotifies()
+ *
+ * Consume notifications which arrived through the path, and remember that
+ * primary server is alive if any came on NOTIFY_CHANNEL.
+ */
+static void
+drainNotifies(ProbeConn *path)
+{
+	PGnotify   *notify;
+
+	while ((notify = PQnotifies(path->conn)) != NULL)
+	{
+		if (strcmp(notify->relname, NOTIFY_CHANNEL) == 0)
+			path->notified = true;
+		PQfreemem(notify);
+	}
+}
+
+/*
+ * sendProbeQuery()
+ *
+ * Send the query through the established connection.
+ */
+static HeartbeatResult
+sendProbeQuery(ProbeConn *probe)
+{
+	probe->query_start_usec = monotonicUsec();
+	switchPhase(probe, PROBE_PHASE_QUERY);
+
+	if (PQsetnonblocking(probe->conn, 1) != 0 ||
+		!PQsendQuery(probe->conn, probe->query))
+	{
+		ereport(LOG,
+				(errmsg("could not send query to %s: %s",
+						probe->name, PQerrorMessage(probe->conn))));
+		disconnectProbe(probe);
+		return HEARTBEAT_FAILED;
+	}
+
+	probe->state = PROBE_FLUSHING;
+	return advanceProbe(probe);
+}
+
+/*
+ * advanceProbe()
+ *
+ * Advance the query in progress as far as possible without blocking.
+ * This is called whenever the socket became ready. Return HEARTBEAT_PENDING
+ * if we have to wait for the socket again, after setting wait_events.
+ *
+ * Once the query failed the connection is closed, so that next query
+ * reconnects to the server from scratch.
+ */
+static HeartbeatResult
+advanceProbe(ProbeConn *probe)
+{
+	PGresult	*res;
+	PostgresPollingStatusType pollres;
+	bool		ok = true;
+
+	if (probe->udp)
+		return receiveUdpProbe(probe);
+
+	switch (probe->state)
+	{
+		case PROBE_CONNECTING:
+			pollres = PQconnectPoll(probe->conn);
+			switchPhase(probe, phaseOfStatus(PQstatus(probe->conn)));
+			tuneProbeSocket(probe);
+
+			switch (pollres)
+			{
+				case PGRES_POLLING_READING:
+					probe->wait_events = WL_SOCKET_READABLE;
+					return HEARTBEAT_PENDING;
+				case PGRES_POLLING_WRITING:
+					probe->wait_events = WL_SOCKET_WRITEABLE;
+					return HEARTBEAT_PENDING;
+				case PGRES_POLLING_OK:
+					if (probe->is_heartbeat)
+						recordLatency(LATENCY_CONNECT,
+									  monotonicUsec() - probe->start_usec);
+					if (probe->query == NULL)
+					{
+						finishPhases(probe);
+						probe->state = PROBE_IDLE;
+						return HEARTBEAT_SUCCEEDED;
+					}
+					return sendProbeQuery(probe);
+				default:
+					ereport(LOG,
+							(errmsg("could not establish connection to %s: %s",
+									probe->name, PQerrorMessage(probe->conn))));
+					disconnectProbe(probe);
+					return HEARTBEAT_FAILED;
+			}
+			break;
+
+		case PROBE_FLUSHING:
+			switch (PQflush(probe->conn))
+			{
+				case 0:
+					/* Whole query has been sent, wait for the result */
+					probe->state = PROBE_BUSY;
+					probe->wait_events = WL_SOCKET_READABLE;
+					return HEARTBEAT_PENDING;
+				case 1:
+					probe->wait_events = WL_SOCKET_WRITEABLE;
+					return HEARTBEAT_PENDING;
+				default:
+					ereport(LOG,
+							(errmsg("could not send query to %s: %s",
+									probe->name, PQerrorMessage(probe->conn))));
+					disconnectProbe(probe);
+					return HEARTBEAT_FAILED;
+			}
+			break;
+
+		case PROBE_BUSY:
+			if (!PQconsumeInput(probe->conn))
+			{
+				ereport(LOG,
+						(errmsg("could not receive result from %s: %s",
+								probe->name, PQerrorMessage(probe->conn))));
+				disconnectProbe(probe);
+				return HEARTBEAT_FAILED;
+			}
+
+			if (PQisBusy(probe->conn))
+				return HEARTBEAT_PENDING;
+
+			/*
+			 * Collect all results so that the connection is ready to reuse.
+			 * Keep the first result except for heartbeats, whose result is
+			 * not interesting. LISTEN of notify mode returns no tuples.
+			 */
+			while ((res = PQgetResult(probe->conn)) != NULL)
+			{
+				if (PQresultStatus(res) != PGRES_TUPLES_OK &&
+					PQresultStatus(res) != PGRES_COMMAND_OK)
+					ok = false;
+
+				if (!probe->is_heartbeat && probe->result == NULL)
+					probe->result = res;
+				else
+					PQclear(res);
+			}
+			break;
+
+		case PROBE_IDLE:
+			elog(ERROR, "no query is in progress on %s", probe->name);
+			break;
+	}
+
+	if (!ok)
+	{
+		ereport(LOG,
+				(errmsg("could not get tuple from %s", probe->name)));
+		disconnectProbe(probe);
+		return HEARTBEAT_FAILED;
+	}
+
+	probe->state = PROBE_IDLE;
+	finishPhases(probe);
+	if (probe->is_heartbeat)
+		recordLatency(LATENCY_QUERY,
+					  monotonicUsec() - probe->query_start_usec);
+
+	/* Notifications may have arrived with the result */
+	if (probe->is_heartbeat)
+		drainNotifies(probe);
+
+	/* Close the connection unless we keep it until next query */
+	if (!promoter_keep_connection &&
+		!(probe->is_heartbeat && promoter_probe_method == PROBE_METHOD_NOTIFY))
+		closeProbeConnection(probe);
+
+	/* The server is alive now */
+	return HEARTBEAT_SUCCEEDED;
+}
+
+/*
+ * setupUdpProbe()
+ *
+ * Send heartbeats through this path to the responder by UDP. The address of
+ * the responder is resolved here unless the caller already knows it.
+ */
+static bool
+setupUdpProbe(ProbeConn *probe, int elevel)
+{
+	probe->udp = true;
+	probe->nonce = (uint32) random() ^ (uint32) MyProcPid ^
+		(uint32) monotonicUsec();
+	probe->seq = 0;
+
+	if (probe->addrlen > 0)
+		return true;
+	return resolveUdpProbe(probe, elevel);
+}
+
+/*
+ * resolveUdpProbe()
+ *
+ * The address of the responder is the host in the conninfo, with
+ * pg_promoter.responder_port. It's resolved only once so that heartbeats
+ * don't depend on DNS. Errors in the configuration are reported at elevel.
+ * If the host can't be resolved, that's logged and false is returned;
+ * sendUdpProbe() tries again at each heartbeat, which fails until then.
+ */
+static bool
+resolveUdpProbe(ProbeConn *probe, int elevel)
+{
+	PQconninfoOption *options;
+	PQconninfoOption *option;
+	char	   *err = NULL;
+	char	   *host = NULL;
+	char		portstr[16];
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	int			ret;
+
+	if (promoter_responder_port == 0)
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_promoter.probe_method = udp requires pg_promoter.responder_port")));
+		return false;
+	}
+
+	if ((options = PQconninfoParse(probe->conninfo, &err)) == NULL)
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid connection string for %s: %s",
+						probe->name, err ? err : "out of memory")));
+		if (err != NULL)
+			PQfreemem(err);
+		return false;
+	}
+
+	/* hostaddr takes precedence over host, as libpq does */
+	for (option = options; option->keyword != NULL; option++)
+	{
+		if (option->val == NULL || option->val[0] == '\0')
+			continue;
+		if (strcmp(option->keyword, "hostaddr") == 0)
+			host = pstrdup(option->val);
+		else if (strcmp(option->keyword, "host") == 0 && host == NULL)
+			host = pstrdup(option->val);
+	}
+	PQconninfoFree(options);
+
+	if (host == NULL || host[0] == '/')
+	{
+		ereport(elevel,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("pg_promoter.probe_method = udp requires a TCP host for %s",
+						probe->name)));
+		return false;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(portstr, sizeof(portstr), "%d", promoter_responder_port);
+
+	if ((ret = getaddrinfo(host, portstr, &hints, &addrs)) != 0 || addrs == NULL)
+	{
+		ereport(LOG,
+				(errmsg("could not resolve \"%s\" for %s: %s",
+						host, probe->name, gai_strerror(ret))));
+		pfree(host);
+		return false;
+	}
+
+	memcpy(&probe->addr, addrs->ai_addr, addrs->ai_addrlen);
+	probe->addrlen = addrs->ai_addrlen;
+	freeaddrinfo(addrs);
+	pfree(host);
+
+	return true;
+}
+
+/*
+ * probeSocket()
+ *
+ * Return the socket to wait for.
+ */
+static pgsocket
+probeSocket(ProbeConn *probe)
+{
+	return probe->udp ? probe->sock : PQsocket(probe->conn);
+}
+
+/*
+ * sendUdpProbe()
+ *
+ * Send a heartbeat packet to the responder. The socket is connected to the
+ * responder, so that an ICMP error tells us immediately that nobody listens
+ * on primary server.
+ */
+static HeartbeatResult
+sendUdpProbe(ProbeConn *probe)
+{
+	HeartbeatPacket packet;
+
+	/* The responder couldn't be resolved yet */
+	if (probe->addrlen == 0 && !resolveUdpProbe(probe, LOG))
+	{
+		disconnectProbe(probe);
+		return HEARTBEAT_FAILED;
+	}
+
+	if (probe->sock == PGINVALID_SOCKET)
+	{
+		probe->sock = socket(probe->addr.ss_family, SOCK_DGRAM, 0);
+		if (probe->sock == PGINVALID_SOCKET ||
+			!pg_set_noblock(probe->sock) ||
+			connect(probe->sock, (struct sockaddr *) &probe->addr,
+					probe->addrlen) < 0)
+		{
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("could not create socket for %s: %m", probe->name)));
+			disconnectProbe(probe);
+			return HEARTBEAT_FAILED;
+		}
+	}
+
+	probe->seq++;
+	probe->query_start_usec = monotonicUsec();
+	switchPhase(probe, PROBE_PHASE_QUERY);
+
+	memcpy(packet.magic, RESPONDER_REQUEST_MAGIC, sizeof(packet.magic));
+	packet.nonce = htonl(probe->nonce);
+	packet.seq_hi = htonl((uint32) (probe->seq >> 32));
+	packet.seq_lo = htonl((uint32) probe->seq);
+
+	if (send(probe->sock, &packet, sizeof(packet), 0) != sizeof(packet))
+	{
+		ereport(LOG,
+				(errcode_for_socket_access(),
+				 errmsg("could not send heartbeat to %s: %m", probe->name)));
+		disconnectProbe(probe);
+		return HEARTBEAT_FAILED;
+	}
+
+	probe->state = PROBE_BUSY;
+	probe->wait_events = WL_SOCKET_READABLE;
+	return HEARTBEAT_PENDING;
+}
+
+/*
+ * receiveUdpProbe()
+ *
+ * Read replies from the responder, and check whether the reply to the last
+ * heartbeat arrived. Replies to earlier heartbeats are discarded.
+ */
+static HeartbeatResult
+receiveUdpProbe(ProbeConn *probe)
+{
+	for (;;)
+	{
+		HeartbeatPacket packet;
+		ssize_t		len;
+
+		len = recv(probe->sock, &packet, sizeof(packet), 0);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return HEARTBEAT_PENDING;
+
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("could not receive heartbeat from %s: %m",
+							probe->name)));
+			disconnectProbe(probe);
+			return HEARTBEAT_FAILED;
+		}
+
+		if (len != sizeof(packet) ||
+			memcmp(packet.magic, RESPONDER_REPLY_MAGIC, sizeof(packet.magic)) != 0 ||
+			ntohl(packet.nonce) != probe->nonce ||
+			((uint64) ntohl(packet.seq_hi) << 32 | ntohl(packet.seq_lo)) != probe->seq)
+			continue;
+
+		break;
+	}
+
+	probe->state = PROBE_IDLE;
+	finishPhases(probe);
+	recordLatency(LATENCY_QUERY, monotonicUsec() - probe->query_start_usec);
+
+	/* The server is alive now */
+	return HEARTBEAT_SUCCEEDED;
+}
+
+/*
+ * startHeartbeat()
+ *
+ * Start heartbeats to primary server through all paths in parallel.
+ */
+static HeartbeatResult
+startHeartbeat(void)
+{
+	HeartbeatResult result = HEARTBEAT_PENDING;
+	int			i;
+
+	probe_start_time = GetCurrentTimestamp();
+	round_succeeded = false;
+
+	my_status.last_probe_time = probe_start_time;
+	publishStatus();
+
+	connectWitnesses();
+
+	/*
+	 * If a recent logical message from primary server arrived in WAL, a
+	 * recent write to the heartbeat table has been replayed, or walreceiver
+	 * received a message from primary server recently, it proves that primary
+	 * server is alive. We don't need any query then.
+	 */
+	if (walMessageIsAlive(probe_start_time) ||
+		heartbeatTableIsAlive(probe_start_time) ||
+		streamIsAlive(probe_start_time))
+	{
+		npending_paths = 0;
+		return HEARTBEAT_SUCCEEDED;
+	}
+
+	npending_paths = nprobe_paths;
+
+	for (i = 0; i < nprobe_paths; i++)
+	{
+		ProbeConn  *path = &probe_paths[i];
+		HeartbeatResult	r;
+
+		/*
+		 * In notify mode, a path succeeds if primary server notified us
+		 * through it since the last heartbeat, without any query. Only a
+		 * path without connection sends LISTEN after connecting, which
+		 * proves that primary server is alive as well.
+		 */
+		if (promoter_probe_method == PROBE_METHOD_NOTIFY)
+		{
+			if (path->conn == NULL)
+				r = startProbe(path, LISTEN_SQL);
+			else
+			{
+				r = path->notified ? HEARTBEAT_SUCCEEDED : HEARTBEAT_FAILED;
+				if (r == HEARTBEAT_FAILED)
+					ereport(LOG,
+							(errmsg("no notification from %s", path->name)));
+			}
+			path->notified = false;
+		}
+		else
+			r = startProbe(path, HEARTBEAT_SQL);
+		if (r != HEARTBEAT_PENDING)
+			r = finishPath(i, r);
+		if (r != HEARTBEAT_PENDING)
+			result = r;
+	}
+
+	return result;
+}
+
+/*
+ * streamIsAlive()
+ *
+ * Return true if walreceiver is streaming and received any message, WAL
+ * data or keepalive, from walsender within pg_promoter.walreceiver_timeout.
+ * This reads walreceiver's shared memory, so it costs no connection to
+ * primary server at all.
+ */
+static bool
+streamIsAlive(TimestampTz now)
+{
+	WalRcvData *walrcv = WalRcv;
+	WalRcvState	state;
+	TimestampTz	receipt_time;
+
+	if (promoter_walreceiver_timeout <= 0 || walrcv == NULL)
+		return false;
+
+	SpinLockAcquire(&walrcv->mutex);
+	state = walrcv->walRcvState;
+	receipt_time = walrcv->lastMsgReceiptTime;
+	SpinLockRelease(&walrcv->mutex);
+
+	if (state != WALRCV_STREAMING || receipt_time == 0)
+		return false;
+
+	my_status.last_stream_time = receipt_time;
+	publishStatus();
+
+	return !TimestampDifferenceExceeds(receipt_time, now,
+									   promoter_walreceiver_timeout);
+}
+
+/*
+ * heartbeatTableIsAlive()
+ *
+ * Return true if the replayed row of the heartbeat table changed within
+ * pg_promoter.heartbeat_table_timeout, which proves that primary server can
+ * commit writes and they reach us. The change is judged by our clock alone,
+ * so this doesn't depend on the clocks.
+ */
+static bool
+heartbeatTableIsAlive(TimestampTz now)
+{
+	if (promoter_heartbeat_table_timeout <= 0 || last_beat_change_time == 0)
+		return false;
+
+	return !TimestampDifferenceExceeds(last_beat_change_time, now,
+									   promoter_heartbeat_table_timeout);
+}
+
+/*
+ * sampleHeartbeatTable()
+ *
+ * Read the row of the heartbeat table replayed on this standby, and compute
+ * the replication latency from the write on primary server to our read,
+ * which assumes that the clocks of both servers are synchronized. The row is
+ * read LIVENESS_SAMPLES times within pg_promoter.heartbeat_table_timeout
+ * regardless of heartbeats, and a change is dated back to the previous read,
+ * which still saw the old row. So the change is never regarded as more recent
+ * than it is.
+ */
+static void
+sampleHeartbeatTable(TimestampTz now)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	StringInfoData buf;
+	TimestampTz	beat_time = 0;
+	bool		failed = false;
+	int			period;
+	int			ret;
+
+	if (promoter_heartbeat_table_interval <= 0 || now < next_beat_sample_time)
+		return;
+
+	/* Only the latency is measured if the row doesn't prove anything */
+	if (promoter_heartbeat_table_timeout > 0)
+		period = Max(promoter_heartbeat_table_timeout / LIVENESS_SAMPLES, 1);
+	else
+		period = heartbeatInterval();
+	next_beat_sample_time = TimestampTzPlusMilliseconds(now, period);
+
+	/*
+	 * The worker is never restarted, so an error here must not end it. The
+	 * table can be dropped or replaced at any time; look it up again then.
+	 */
+	PG_TRY();
+	{
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "reading heartbeat table");
+
+		if (heartbeat_table.schema != NULL || lookupHeartbeatTable())
+		{
+			initStringInfo(&buf);
+			appendStringInfo(&buf, "select beat_time from %s.%s where id = 1",
+							 quote_identifier(heartbeat_table.schema),
+							 quote_identifier(heartbeat_table.name));
+
+			ret = SPI_execute(buf.data, true, 1);
+			if (ret == SPI_OK_SELECT && SPI_processed == 1)
+			{
+				bool		isnull;
+				Datum		val;
+
+				val = SPI_getbinval(SPI_tuptable->vals[0],
+									SPI_tuptable->tupdesc, 1, &isnull);
+				if (!isnull)
+					beat_time = DatumGetTimestampTz(val);
+			}
+		}
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		EmitErrorReport();
+		AbortCurrentTransaction();
+		FlushErrorState();
+		MemoryContextSwitchTo(oldcontext);
+
+		if (heartbeat_table.schema != NULL)
+			pfree((char *) heartbeat_table.schema);
+		heartbeat_table.schema = NULL;
+		failed = true;
+	}
+	PG_END_TRY();
+
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	/* The previous read is still the last one that saw the row */
+	if (failed)
+		return;
+
+	if (beat_time != 0)
+	{
+		/* We don't know when the first row we saw was written */
+		if (beat_time != last_table_beat_time)
+		{
+			if (last_table_beat_time != 0)
+				last_beat_change_time = last_beat_sample_time;
+			last_table_beat_time = beat_time;
+		}
+
+		/* Publish the latest heartbeat of the table or WAL */
+		if (beat_time > my_status.last_beat_time)
+		{
+			my_status.last_beat_time = beat_time;
+			my_status.replication_latency = elapsedUsec(beat_time, now);
+			publishStatus();
+		}
+	}
+
+	last_beat_sample_time = now;
+}
+
+/*
+ * lookupHeartbeatTable()
+ *
+ * Find the schema of the heartbeat table, that is, of pg_promoter extension.
+ * Must be called in a transaction, connected to SPI. Return false if the
+ * extension is not created.
+ */
+static bool
+lookupHeartbeatTable(void)
+{
+	int			ret;
+
+	ret = SPI_execute("select n.nspname from pg_catalog.pg_extension e"
+					  " join pg_catalog.pg_namespace n on n.oid = e.extnamespace"
+					  " where e.extname = 'pg_promoter'", true, 1);
+
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+	{
+		/* This is tried at every read, but logged only once */
+		if (!heartbeat_table_missing)
+			ereport(LOG,
+					(errmsg("heartbeat table is not available because pg_promoter extension is not created in database \"%s\"",
+							promoter_database)));
+		heartbeat_table_missing = true;
+		return false;
+	}
+
+	heartbeat_table_missing = false;
+
+	heartbeat_table.schema =
+		MemoryContextStrdup(TopMemoryContext,
+							SPI_getvalue(SPI_tuptable->vals[0],
+										 SPI_tuptable->tupdesc, 1));
+	return true;
+}
+
+/*
+ * walMessageIsAlive()
+ *
+ * Return true if a logical message from primary server arrived in WAL within
+ * pg_promoter.wal_message_timeout. It proves that primary server can write
+ * WAL and replication streams it to us, without any connection.
+ */
+static bool
+walMessageIsAlive(TimestampTz now)
+{
+	if (promoter_wal_message_timeout <= 0 || last_wal_message_time == 0)
+		return false;
+
+	return !TimestampDifferenceExceeds(last_wal_message_time, now,
+									   promoter_wal_message_timeout);
+}
+
+/*
+ * readWalMessages()
+ *
+ * Read WAL records which walreceiver has flushed since the last call, and
+ * pick up logical messages from primary server. Each message carries the
+ * time on primary server when it was written, which gives a sample of the
+ * replication latency. We read WAL by ourselves rather than waiting for the
+ * replay, so that a replay backlog doesn't delay the detection.
+ *
+ * A message is dated back to the last call which read all WAL received by
+ * then, since the message must have arrived after it. The main loop calls
+ * this LIVENESS_SAMPLES times within pg_promoter.wal_message_timeout at
+ * least. At most WAL_MESSAGE_READ_LIMIT bytes are read at once, so that a
+ * large backlog, e.g. after start, doesn't stall heartbeats; the main loop
+ * calls this again without sleeping until we catch up.
+ */
+static void
+readWalMessages(TimestampTz now)
+{
+	XLogRecPtr	received;
+	XLogRecPtr	limit;
+	XLogRecord *record;
+	char	   *errormsg;
+	bool		caught_up = true;
+	int			period;
+
+	if (promoter_wal_message_timeout <= 0)
+		return;
+
+	period = Max(promoter_wal_message_timeout / LIVENESS_SAMPLES, 1);
+	next_wal_read_time = TimestampTzPlusMilliseconds(now, period);
+
+	if (wal_reader == NULL)
+	{
+		wal_reader = XLogReaderAllocate(walMessagePageRead, NULL);
+		if (wal_reader == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory"),
+					 errdetail("Failed while allocating an XLog reading processor.")));
+	}
+
+	/* Start from the next record to replay, which is a record boundary */
+	if (XLogRecPtrIsInvalid(wal_read_ptr))
+		wal_read_ptr = GetXLogReplayRecPtr(NULL);
+
+	received = GetWalRcvWriteRecPtr(NULL, NULL);
+	limit = wal_read_ptr + WAL_MESSAGE_READ_LIMIT;
+	wal_read_behind = false;
+
+	while (wal_read_ptr < received)
+	{
+		if (wal_read_ptr >= limit)
+		{
+			wal_read_behind = true;
+			caught_up = false;
+			break;
+		}
+
+		wal_read_failed = false;
+		record = XLogReadRecord(wal_reader, wal_read_ptr, &errormsg);
+		if (record == NULL)
+		{
+			/*
+			 * Usually the rest of the record hasn't arrived yet, so try again
+			 * later. If the record is invalid, e.g. across a timeline switch,
+			 * or its segment was already removed or recycled, resume from the
+			 * replay position once it passed the record.
+			 */
+			if (errormsg != NULL || wal_read_failed)
+			{
+				caught_up = false;
+				if (GetXLogReplayRecPtr(NULL) > wal_read_ptr)
+					wal_read_ptr = GetXLogReplayRecPtr(NULL);
+			}
+			break;
+		}
+		wal_read_ptr = wal_reader->EndRecPtr;
+
+		if (XLogRecGetRmid(wal_reader) == RM_LOGICALMSG_ID &&
+			(XLogRecGetInfo(wal_reader) & ~XLR_INFO_MASK) == XLOG_LOGICAL_MESSAGE)
+		{
+			xl_logical_message *xlrec = (xl_logical_message *) XLogRecGetData(wal_reader);
+			TimestampTz	sent_time;
+
+			if (xlrec->prefix_size != sizeof(WAL_MESSAGE_PREFIX) ||
+				strcmp(xlrec->message, WAL_MESSAGE_PREFIX) != 0 ||
+				xlrec->message_size != sizeof(TimestampTz))
+				continue;
+
+			memcpy(&sent_time, xlrec->message + xlrec->prefix_size,
+				   sizeof(TimestampTz));
+
+			/* We can't tell when messages found before catching up arrived */
+			if (wal_caught_up_time > last_wal_message_time)
+				last_wal_message_time = wal_caught_up_time;
+
+			/* Publish the latest heartbeat of the table or WAL */
+			if (sent_time > my_status.last_beat_time)
+			{
+				my_status.last_beat_time = sent_time;
+				my_status.replication_latency = elapsedUsec(sent_time, now);
+				publishStatus();
+			}
+		}
+	}
+
+	if (caught_up)
+		wal_caught_up_time = now;
+}
+
+/*
+ * walMessagePageRead()
+ *
+ * Read a page of WAL from pg_xlog, only up to the position walreceiver has
+ * flushed. Unlike read_local_xlog_page(), never wait for more WAL, so that
+ * the main loop doesn't block. XLogReadRecord() doesn't tell a page that
+ * hasn't arrived from one that can't be read, so the latter sets
+ * wal_read_failed.
+ */
+static int
+walMessagePageRead(XLogReaderState *reader, XLogRecPtr targetPagePtr,
+				   int reqLen, XLogRecPtr targetRecPtr, char *readBuf,
+				   TimeLineID *pageTLI)
+{
+	XLogRecPtr	received;
+	TimeLineID	tli;
+	XLogSegNo	segno;
+	uint32		offset;
+	int			count;
+
+	received = GetWalRcvWriteRecPtr(NULL, &tli);
+
+	if (targetPagePtr + reqLen > received)
+		return -1;
+
+	if (targetPagePtr + XLOG_BLCKSZ <= received)
+		count = XLOG_BLCKSZ;
+	else
+		count = received - targetPagePtr;
+
+	XLByteToSeg(targetPagePtr, segno);
+	offset = targetPagePtr % XLogSegSize;
+
+	if (wal_read_fd < 0 || segno != wal_read_segno)
+	{
+		char		path[MAXPGPATH];
+
+		if (wal_read_fd >= 0)
+			close(wal_read_fd);
+
+		XLogFilePath(path, tli, segno);
+		wal_read_fd = BasicOpenFile(path, O_RDONLY | PG_BINARY, 0);
+		if (wal_read_fd < 0)
+		{
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+			wal_read_failed = true;
+			return -1;
+		}
+		wal_read_segno = segno;
+	}
+
+	if (lseek(wal_read_fd, (off_t) offset, SEEK_SET) < 0 ||
+		read(wal_read_fd, readBuf, XLOG_BLCKSZ) != XLOG_BLCKSZ)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not read WAL at %X/%X: %m",
+						(uint32) (targetPagePtr >> 32),
+						(uint32) targetPagePtr)));
+		close(wal_read_fd);
+		wal_read_fd = -1;
+		wal_read_failed = true;
+		return -1;
+	}
+
+	*pageTLI = tli;
+	return count;
+}
+
+/*
+ * finishPath()
+ *
+ * Record the result of the heartbeat through the path. Return the result of
+ * the whole heartbeat once it's decided: primary server is alive if any path
+ * succeeded, and is dead only if all paths failed. Otherwise return
+ * HEARTBEAT_PENDING.
+ */
+static HeartbeatResult
+finishPath(int pathno, HeartbeatResult result)
+{
+	PathStatus *pstatus = &my_status.paths[pathno];
+	TimestampTz	now = GetCurrentTimestamp();
+
+	Assert(npending_paths > 0);
+	npending_paths--;
+
+	if (result == HEARTBEAT_SUCCEEDED)
+	{
+		if (pstatus->consecutive_failures > 0)
+			ereport(LOG,
+					(errmsg("%s is available again after %d failure(s)",
+							probe_paths[pathno].name,
+							pstatus->consecutive_failures)));
+
+		pstatus->consecutive_failures = 0;
+		pstatus->last_success_time = now;
+		pstatus->last_rtt = elapsedUsec(probe_start_time, now);
+	}
+	else
+		pstatus->consecutive_failures++;
+	publishStatus();
+
+	if (result == HEARTBEAT_SUCCEEDED && !round_succeeded)
+	{
+		round_succeeded = true;
+		return HEARTBEAT_SUCCEEDED;
+	}
+
+	if (npending_paths == 0 && !round_succeeded)
+		return HEARTBEAT_FAILED;
+
+	return HEARTBEAT_PENDING;
+}
+
+/*
+ * disconnectPrimaryServer()
+ *
+ * Close connections through all paths.
+ */
+static void
+disconnectPrimaryServer(void)
+{
+	int			i;
+
+	for (i = 0; i < nprobe_paths; i++)
+		disconnectProbe(&probe_paths[i]);
+	npending_paths = 0;
+}
+
+/*
+ * connectWitnesses()
+ *
+ * Establish connections to peer standbys in background, so that the
+ * confirmation costs only one round trip when it's needed. Peers which
+ * couldn't be reached are redialed after the backoff set by finishWitness().
+ */
+static void
+connectWitnesses(void)
+{
+	TimestampTz	now = GetCurrentTimestamp();
+	int			i;
+
+	for (i = 0; i < nwitnesses; i++)
+	{
+		ProbeConn  *witness = &witnesses[i];
+		HeartbeatResult r;
+
+		if (witness->conn != NULL || witness->state != PROBE_IDLE ||
+			now < witness->next_connect_time)
+			continue;
+
+		if ((r = startProbe(witness, NULL)) != HEARTBEAT_PENDING)
+			(void) finishWitness(witness, r);
+	}
+}
+
+/*
+ * startConfirmation()
+ *
+ * Ask all peer standbys in parallel whether they can reach primary server.
+ */
+static void
+startConfirmation(void)
+{
+	int			i;
+
+	ereport(LOG,
+			(errmsg("asking %d peer server(s) to confirm failure of primary server",
+					nwitnesses)));
+
+	confirming = true;
+	confirm_start_time = GetCurrentTimestamp();
+	npending_witnesses = nwitnesses;
+	nagreed_witnesses = 0;
+	memset(candidates, 0, sizeof(candidates));
+
+	my_status.state = PROMOTER_STATE_CONFIRMING;
+	publishStatus();
+
+	for (i = 0; i < nwitnesses; i++)
+	{
+		ProbeConn  *witness = &witnesses[i];
+		HeartbeatResult r;
+
+		/* The query is sent once the connection in progress is established */
+		if (witness->state != PROBE_IDLE)
+		{
+			witness->query = WITNESS_SQL;
+			continue;
+		}
+
+		if ((r = startProbe(witness, WITNESS_SQL)) != HEARTBEAT_PENDING)
+			(void) finishWitness(witness, r);
+	}
+}
+
+/*
+ * finishWitness()
+ *
+ * Record the answer of the peer standby, and return the result of the whole
+ * confirmation once it's decided. A peer which could not answer is regarded
+ * as disagreeing, so that a standby isolated from everyone never promotes.
+ */
+static ConfirmationResult
+finishWitness(ProbeConn *witness, HeartbeatResult result)
+{
+	/*
+	 * Back off redialing a peer which can't be reached exponentially, so
+	 * that it doesn't flood the log with the same error every heartbeat.
+	 */
+	if (result == HEARTBEAT_FAILED)
+	{
+		int64		backoff;
+
+		backoff = (int64) heartbeatInterval() << Min(witness->nfailures, 16);
+		witness->nfailures++;
+		witness->next_connect_time =
+			TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										Min(backoff, MAX_REDIAL_INTERVAL));
+	}
+	else if (result == HEARTBEAT_SUCCEEDED)
+	{
+		witness->nfailures = 0;
+		witness->next_connect_time = 0;
+	}
+
+	/* Ignore connections established in background */
+	if (!confirming || witness->query == NULL)
+		return CONFIRMATION_PENDING;
+
+	Assert(npending_witnesses > 0);
+	npending_witnesses--;
+	witness->query = NULL;
+
+	if (result == HEARTBEAT_SUCCEEDED)
+	{
+		PGresult   *res = witness->result;
+		Candidate  *candidate = &candidates[witness - witnesses];
+
+		if (res != NULL && PQntuples(res) == 1 && PQnfields(res) == 6)
+		{
+			uint32		hi,
+						lo;
+
+			candidate->answered = true;
+			candidate->agrees = strcmp(PQgetvalue(res, 0, 0), "t") == 0;
+			candidate->promoted =
+				strcmp(PQgetvalue(res, 0, 1),
+					   PromoterStateNames[PROMOTER_STATE_PROMOTING]) == 0 ||
+				strcmp(PQgetvalue(res, 0, 1),
+					   PromoterStateNames[PROMOTER_STATE_PROMOTED]) == 0;
+			if (sscanf(PQgetvalue(res, 0, 2), "%X/%X", &hi, &lo) == 2)
+				candidate->received = ((uint64) hi) << 32 | lo;
+			if (sscanf(PQgetvalue(res, 0, 3), "%X/%X", &hi, &lo) == 2)
+				candidate->replayed = ((uint64) hi) << 32 | lo;
+			candidate->priority = atoi(PQgetvalue(res, 0, 4));
+			strlcpy(candidate->name, PQgetvalue(res, 0, 5), NAMEDATALEN);
+		}
+
+		if (candidate->answered && candidate->agrees)
+		{
+			nagreed_witnesses++;
+			ereport(LOG,
+					(errmsg("%s reports that primary server is unreachable",
+							witness->name)));
+		}
+		else
+			ereport(LOG,
+					(errmsg("%s reports that primary server is reachable",
+							witness->name)));
+	}
+
+	/* The election needs the positions of all peers */
+	if (nagreed_witnesses >= promoter_witness_quorum &&
+		(!promoter_election || npending_witnesses == 0))
+		return CONFIRMATION_ACCEPTED;
+
+	if (nagreed_witnesses + npending_witnesses < promoter_witness_quorum)
+		return CONFIRMATION_REJECTED;
+
+	return CONFIRMATION_PENDING;
+}
+
+/*
+ * cancelConfirmation()
+ *
+ * Give up the confirmation in progress. Peers which haven't answered yet are
+ * disconnected so that their late answers are not mixed up with the next
+ * confirmation.
+ */
+static void
+cancelConfirmation(void)
+{
+	int			i;
+
+	for (i = 0; i < nwitnesses; i++)
+	{
+		if (witnesses[i].query != NULL)
+			disconnectProbe(&witnesses[i]);
+		witnesses[i].query = NULL;
+	}
+
+	confirming = false;
+	npending_witnesses = 0;
+}
+
+/*
+ * compareCandidates()
+ *
+ * Return a positive value if candidate a is better than b, negative if worse,
+ * or 0 if we can't tell them apart.
+ */
+static int
+compareCandidates(Candidate *a, Candidate *b)
+{
+	if (a->received != b->received)
+		return a->received > b->received ? 1 : -1;
+	if (a->replayed != b->replayed)
+		return a->replayed > b->replayed ? 1 : -1;
+	if (a->priority != b->priority)
+		return a->priority > b->priority ? 1 : -1;
+	return strcmp(a->name, b->name);
+}
+
+/*
+ * electWinner()
+ *
+ * Elect the standby to promote among ourselves and peers which confirmed
+ * failure of primary server. Return the index of the winner in witnesses,
+ * -1 if we won, or -2 if nobody should promote, after logging why. A peer
+ * which already decided to promote wins regardless of its position, since
+ * it's too late to stop it.
+ *
+ * If the best candidates tie, each of them would elect itself, so nobody is
+ * elected rather than promoting more than one standby.
+ */
+static int
+electWinner(void)
+{
+	Candidate	self;
+	Candidate  *best = &self;
+	int			winner = -1;
+	int			tied = -1;		/* peer tying with the best, if any */
+	int			cmp;
+	int			i;
+
+	memset(&self, 0, sizeof(Candidate));
+	self.received = GetWalRcvWriteRecPtr(NULL, NULL);
+	self.replayed = GetXLogReplayRecPtr(NULL);
+	self.priority = promoter_priority;
+	strlcpy(self.name, cluster_name, NAMEDATALEN);
+
+	for (i = 0; i < nwitnesses; i++)
+	{
+		Candidate  *candidate = &candidates[i];
+
+		if (!candidate->answered)
+			continue;
+
+		if (candidate->promoted)
+			return i;
+
+		if (!candidate->agrees || candidate->priority <= 0)
+			continue;
+
+		if (best->priority > 0)
+		{
+			cmp = compareCandidates(candidate, best);
+			if (cmp == 0)
+				tied = i;
+			if (cmp <= 0)
+				continue;
+		}
+
+		best = candidate;
+		winner = i;
+		tied = -1;
+	}
+
+	/* Nobody can promote if all candidates have priority 0 */
+	if (best->priority <= 0)
+	{
+		ereport(LOG,
+				(errmsg("no standby server can promote because pg_promoter.priority is 0")));
+		return -2;
+	}
+
+	if (tied >= 0)
+	{
+		ereport(LOG,
+				(errmsg("could not elect a standby server to promote because %s and %s are in the same position",
+						winner >= 0 ? witnesses[winner].name : "this server",
+						witnesses[tied].name),
+				 errhint("Set cluster_name to a unique name on each standby server.")));
+		return -2;
+	}
+
+	return winner;
+}
+
+/*
+ * startFollowing()
+ *
+ * Wait for the winner of the election to be promoted, up to
+ * pg_promoter.election_timeout.
+ */
+static void
+startFollowing(int winner, TimestampTz now)
+{
+	following = true;
+	winner_index = winner;
+	follow_end_time = TimestampTzPlusMilliseconds(now,
+												  promoter_election_timeout);
+	next_winner_check_time = now;
+
+	my_status.state = PROMOTER_STATE_FOLLOWING;
+	publishStatus();
+}
+
+/*
+ * finishFollowing()
+ *
+ * Check the answer from the winner of the election. Return true if it has
+ * been promoted, in which case the caller should monitor it as new primary
+ * server by retargetPrimary(). That moves connections around, so it must not
+ * be done while other events of the same wait are still to be dispatched.
+ */
+static bool
+finishFollowing(HeartbeatResult result)
+{
+	ProbeConn  *winner = &witnesses[winner_index];
+	PGresult   *res = winner->result;
+
+	winner->query = NULL;
+
+	if (result != HEARTBEAT_SUCCEEDED || res == NULL ||
+		PQntuples(res) != 1 || strcmp(PQgetvalue(res, 0, 0), "t") != 0)
+		return false;
+
+	ereport(LOG,
+			(errmsg("%s has been promoted, monitoring it as primary server",
+					winner->name)));
+	return true;
+}
+
+/*
+ * retargetPrimary()
+ *
+ * Replace primary server by the winner of the election, which is not a peer
+ * any more. Note that this doesn't change primary_conninfo of walreceiver.
+ */
+static void
+retargetPrimary(void)
+{
+	ProbeConn  *winner = &witnesses[winner_index];
+	char		conninfo[MAXPGPATH];
+	struct sockaddr_storage addr;
+	socklen_t	addrlen = 0;
+
+	strlcpy(conninfo, winner->conninfo, MAXPGPATH);
+
+	/*
+	 * Take the address of the responder from the connection to the winner
+	 * if any, so that the main loop doesn't wait for DNS.
+	 */
+	if (promoter_probe_method == PROBE_METHOD_UDP && winner->conn != NULL)
+	{
+		addrlen = sizeof(addr);
+		if (getpeername(PQsocket(winner->conn), (struct sockaddr *) &addr,
+						&addrlen) < 0)
+			addrlen = 0;
+		else if (addr.ss_family == AF_INET)
+			((struct sockaddr_in *) &addr)->sin_port =
+				htons((uint16) promoter_responder_port);
+#ifdef HAVE_IPV6
+		else if (addr.ss_family == AF_INET6)
+			((struct sockaddr_in6 *) &addr)->sin6_port =
+				htons((uint16) promoter_responder_port);
+#endif
+		else
+			addrlen = 0;
+	}
+
+	disconnectPrimaryServer();
+	disconnectProbe(&prewarm_probe);
+	disconnectProbe(winner);
+
+	nprobe_paths = 1;
+	initProbe(&probe_paths[0], conninfo, true);
+	snprintf(probe_paths[0].name, NAMEDATALEN, "primary server via path 1");
+	if (promoter_probe_method == PROBE_METHOD_UDP)
+	{
+		memcpy(&probe_paths[0].addr, &addr, addrlen);
+		probe_paths[0].addrlen = addrlen;
+		(void) setupUdpProbe(&probe_paths[0], LOG);
+	}
+	initProbe(&prewarm_probe, conninfo, false);
+	snprintf(prewarm_probe.name, NAMEDATALEN, "primary server for prewarm");
+
+	memmove(&witnesses[winner_index], &witnesses[winner_index + 1],
+			sizeof(ProbeConn) * (nwitnesses - winner_index - 1));
+	nwitnesses--;
+
+	following = false;
+	retry_count = 0;
+	last_success_time = GetCurrentTimestamp();
+	next_probe_usec = monotonicUsec();
+	resetArrivalWindow();
+
+	my_status.state = PROMOTER_STATE_HEALTHY;
+	my_status.consecutive_failures = 0;
+	my_status.timeline[TIMELINE_FIRST_FAILURE] = 0;
+	my_status.npaths = 1;
+	memset(my_status.paths, 0, sizeof(my_status.paths));
+	publishStatus();
+}
+
+/*
+ * decidePromotion()
+ *
+ * Promote the standby server to master server, and exit. Return only if
+ * fencing of primary server failed and pg_promoter.fence_policy doesn't
+ * allow to promote anyway.
+ */
+static void
+decidePromotion(TimestampTz now)
+{
+	int			i;
+
+	my_status.state = PROMOTER_STATE_PROMOTING;
+	my_status.decision_time = now;
+	recordTimeline(TIMELINE_DECISION, now);
+
+	if (!fencePrimary())
+	{
+		if (promoter_fence_policy == FENCE_POLICY_REQUIRED)
+		{
+			ereport(LOG,
+					(errmsg("not promoting standby server because fencing of primary server failed")));
+			my_status.state = PROMOTER_STATE_SUSPECT;
+			my_status.decision_time = 0;
+			my_status.timeline[TIMELINE_DECISION] = 0;
+			my_status.timeline[TIMELINE_FENCED] = 0;
+			publishStatus();
+			return;
+		}
+
+		ereport(LOG,
+				(errmsg("promoting standby server although fencing of primary server failed")));
+	}
+
+	disconnectPrimaryServer();
+	for (i = 0; i < nwitnesses; i++)
+		disconnectProbe(&witnesses[i]);
+	disconnectProbe(&prewarm_probe);
+
+	waitForCatchup();
+	doPromote();
+	waitForPromotion();
+	runPostPromoteCommands();
+	proc_exit(0);
+}
+
+/*
+ * waitForPromotion()
+ *
+ * Stay alive until the standby server finishes promotion, recording when the
+ * startup process consumed the promote file and when the server started to
+ * accept writes. The timeline is written to the file after each stage.
+ */
+static void
+waitForPromotion(void)
+{
+	char		trigger_filepath[MAXPGPATH];
+	struct stat	st;
+	double		detection;
+	double		promotion;
+
+	snprintf(trigger_filepath, MAXPGPATH, "%s/promote", DataDir);
+
+	writeTimelineFile();
+
+	while (RecoveryInProgress())
+	{
+		int			rc;
+
+		/* Startup process removes the promote file when ending recovery */
+		if (my_status.timeline[TIMELINE_END_OF_RECOVERY] == 0 &&
+			stat(trigger_filepath, &st) != 0 && errno == ENOENT)
+		{
+			recordTimeline(TIMELINE_END_OF_RECOVERY, GetCurrentTimestamp());
+			writeTimelineFile();
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   PROMOTION_CHECK_INTERVAL);
+		ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+
+		if (got_sigterm)
+			proc_exit(1);
+	}
+
+	/* The promote file may be consumed between our checks */
+	if (my_status.timeline[TIMELINE_END_OF_RECOVERY] == 0)
+		recordTimeline(TIMELINE_END_OF_RECOVERY, GetCurrentTimestamp());
+	recordTimeline(TIMELINE_WRITABLE, GetCurrentTimestamp());
+
+	my_status.state = PROMOTER_STATE_PROMOTED;
+	publishStatus();
+	writeTimelineFile();
+
+	/*
+	 * Report how long detection and promotion took. Detection is counted
+	 * from the first failed heartbeat if any.
+	 */
+	detection = my_status.timeline[TIMELINE_FIRST_FAILURE] != 0 ?
+		(double) elapsedUsec(my_status.timeline[TIMELINE_FIRST_FAILURE],
+							 my_status.timeline[TIMELINE_DECISION]) / 1000.0 : 0;
+	promotion = (double) elapsedUsec(my_status.timeline[TIMELINE_DECISION],
+									 my_status.timeline[TIMELINE_WRITABLE]) / 1000.0;
+
+	ereport(LOG,
+			(errmsg("standby server has been promoted: detection %.1f ms, promotion %.1f ms",
+					detection, promotion)));
+
+	if (expected_catchup >= 0)
+		ereport(LOG,
+				(errmsg("end of recovery took %.1f ms, expected %.1f ms",
+						(double) elapsedUsec(my_status.timeline[TIMELINE_TRIGGER],
+											 my_status.timeline[TIMELINE_END_OF_RECOVERY]) / 1000.0,
+						(double) expected_catchup / 1000.0)));
+}
+
+/*
+ * fencePrimary()
+ *
+ * Run pg_promoter.fence_command to make sure that old primary server can't
+ * come back and accept writes, e.g. by powering it off or revoking its
+ * address. Return true if it succeeded within pg_promoter.fence_timeout, or
+ * fencing is not configured.
+ */
+static bool
+fencePrimary(void)
+{
+	ChildCommand fence;
+
+	if (promoter_fence_command == NULL || promoter_fence_command[0] == '\0')
+		return true;
+
+	memset(&fence, 0, sizeof(ChildCommand));
+	fence.name = "fence command";
+	fence.command = promoter_fence_command;
+
+	runCommands(&fence, 1, promoter_fence_timeout);
+
+	recordTimeline(TIMELINE_FENCED, GetCurrentTimestamp());
+	writeTimelineFile();
+
+	return !fence.timedout &&
+		WIFEXITED(fence.exitstatus) && WEXITSTATUS(fence.exitstatus) == 0;
+}
+
+/*
+ * runPostPromoteCommands()
+ *
+ * Run pg_promoter.post_promote_command in parallel as soon as the promoted
+ * server accepts writes, e.g. to point connection poolers at it, so that
+ * clients are redirected without waiting for DNS or manual operation.
+ */
+static void
+runPostPromoteCommands(void)
+{
+	List	   *command_list;
+	ChildCommand *commands;
+	ListCell   *lc;
+	int			ncommands = 0;
+	int			nsucceeded = 0;
+	int			i;
+
+	if (promoter_post_promote_command == NULL ||
+		promoter_post_promote_command[0] == '\0')
+		return;
+
+	command_list = splitCommandList(promoter_post_promote_command);
+	if (command_list == NIL)
+		return;
+
+	commands = palloc0(sizeof(ChildCommand) * list_length(command_list));
+	foreach(lc, command_list)
+	{
+		ChildCommand *cmd = &commands[ncommands++];
+
+		cmd->name = psprintf("post-promotion command %d", ncommands);
+		cmd->command = (char *) lfirst(lc);
+	}
+
+	runCommands(commands, ncommands, promoter_post_promote_timeout);
+
+	for (i = 0; i < ncommands; i++)
+	{
+		if (!commands[i].timedout && WIFEXITED(commands[i].exitstatus) &&
+			WEXITSTATUS(commands[i].exitstatus) == 0)
+			nsucceeded++;
+	}
+
+	recordTimeline(TIMELINE_POST_PROMOTE, GetCurrentTimestamp());
+	writeTimelineFile();
+
+	ereport(LOG,
+			(errmsg("%d of %d post-promotion command(s) succeeded in %.1f ms after promotion",
+					nsucceeded, ncommands,
+					(double) elapsedUsec(my_status.timeline[TIMELINE_WRITABLE],
+										 my_status.timeline[TIMELINE_POST_PROMOTE]) / 1000.0)));
+}
+
+/*
+ * runCommands()
+ *
+ * Run the shell commands in parallel, and wait for all of them to finish.
+ * Commands which don't finish within timeout milliseconds are killed. The
+ * result of each command is logged.
+ */
+static void
+runCommands(ChildCommand *commands, int ncommands, int timeout)
+{
+	int64		deadline_usec = monotonicUsec() + (int64) timeout * 1000;
+	int			nrunning = 0;
+	int			i;
+
+	for (i = 0; i < ncommands; i++)
+	{
+		ChildCommand *cmd = &commands[i];
+
+		cmd->start_usec = monotonicUsec();
+		fflush(stdout);
+		fflush(stderr);
+
+		if ((cmd->pid = fork()) == 0)
+		{
+			/* Child process, in its own process group */
+			setsid();
+			pqsignal(SIGTERM, SIG_DFL);
+			pqsignal(SIGHUP, SIG_DFL);
+			PG_SETMASK(&UnBlockSig);
+			execl("/bin/sh", "sh", "-c", cmd->command, (char *) NULL);
+			_exit(127);
+		}
+		else if (cmd->pid < 0)
+		{
+			ereport(LOG,
+					(errmsg("could not fork %s: %m", cmd->name)));
+			cmd->pid = 0;
+			cmd->exitstatus = -1;
+			continue;
+		}
+
+		nrunning++;
+	}
+
+	while (nrunning > 0)
+	{
+		int64		now_usec;
+		int			rc;
+
+		for (i = 0; i < ncommands; i++)
+		{
+			ChildCommand *cmd = &commands[i];
+
+			if (cmd->pid == 0 || waitpid(cmd->pid, &cmd->exitstatus, WNOHANG) == 0)
+				continue;
+
+			cmd->elapsed_usec = monotonicUsec() - cmd->start_usec;
+			cmd->pid = 0;
+			nrunning--;
+
+			if (WIFEXITED(cmd->exitstatus) && WEXITSTATUS(cmd->exitstatus) == 0)
+				ereport(LOG,
+						(errmsg("%s succeeded in %.1f ms",
+								cmd->name, (double) cmd->elapsed_usec / 1000.0)));
+			else
+				ereport(LOG,
+						(errmsg("%s failed with status %d in %.1f ms",
+								cmd->name, cmd->exitstatus,
+								(double) cmd->elapsed_usec / 1000.0),
+						 errdetail("The failed command was: %s", cmd->command)));
+		}
+
+		if (nrunning == 0)
+			break;
+
+		now_usec = monotonicUsec();
+		if (now_usec >= deadline_usec)
+		{
+			/* Kill the rest, and reap them */
+			for (i = 0; i < ncommands; i++)
+			{
+				ChildCommand *cmd = &commands[i];
+
+				if (cmd->pid == 0)
+					continue;
+
+				kill(-cmd->pid, SIGKILL);
+				(void) waitpid(cmd->pid, &cmd->exitstatus, 0);
+				cmd->elapsed_usec = monotonicUsec() - cmd->start_usec;
+				cmd->timedout = true;
+				cmd->pid = 0;
+
+				ereport(LOG,
+						(errmsg("%s timed out after %d ms", cmd->name, timeout),
+						 errdetail("The failed command was: %s", cmd->command)));
+			}
+			break;
+		}
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   Min(PROMOTION_CHECK_INTERVAL,
+						   (deadline_usec - now_usec + 999) / 1000));
+		ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+}
+
+/*
+ * sampleReplay()
+ *
+ * Update the amount of WAL which has been received but not replayed yet,
+ * and the replay rate. The rate is measured only while there was a backlog,
+ * otherwise it would be the rate WAL arrives at rather than the rate startup
+ * process can replay at. It's smoothed by exponential moving average.
+ */
+static void
+sampleReplay(TimestampTz now)
+{
+	XLogRecPtr	received = GetWalRcvWriteRecPtr(NULL, NULL);
+	XLogRecPtr	replayed = GetXLogReplayRecPtr(NULL);
+	int64		elapsed;
+
+	if (last_replay_sample_time != 0 &&
+		!TimestampDifferenceExceeds(last_replay_sample_time, now,
+									REPLAY_SAMPLE_INTERVAL))
+		return;
+
+	if (last_replay_sample_time != 0 && my_status.replay_lag > 0 &&
+		replayed >= last_replay_lsn &&
+		(elapsed = elapsedUsec(last_replay_sample_time, now)) > 0)
+	{
+		double		rate = (double) (replayed - last_replay_lsn) * 1000000.0 / elapsed;
+
+		if (my_status.replay_rate == 0)
+			my_status.replay_rate = rate;
+		else
+			my_status.replay_rate = 0.8 * my_status.replay_rate + 0.2 * rate;
+	}
+
+	my_status.replay_lag = received > replayed ? (int64) (received - replayed) : 0;
+	last_replay_lsn = replayed;
+	last_replay_sample_time = now;
+	publishStatus();
+}
+
+/*
+ * expectedCatchup()
+ *
+ * Estimate how long startup process takes to replay the backlog, in usec.
+ * Return -1 if the replay rate is not known yet.
+ */
+static int64
+expectedCatchup(void)
+{
+	if (my_status.replay_lag == 0)
+		return 0;
+	if (my_status.replay_rate <= 0)
+		return -1;
+
+	return (int64) ((double) my_status.replay_lag * 1000000.0 /
+					my_status.replay_rate);
+}
+
+/*
+ * waitForCatchup()
+ *
+ * Wait for startup process to replay the backlog before promotion, as long as
+ * it's expected to finish within pg_promoter.catchup_timeout. Otherwise, or
+ * if the rate is unknown, promote at once.
+ */
+static void
+waitForCatchup(void)
+{
+	TimestampTz	start = GetCurrentTimestamp();
+	TimestampTz	deadline;
+	int64		expected;
+
+	last_replay_sample_time = 0;
+	sampleReplay(start);
+	expected = expectedCatchup();
+
+	if (my_status.replay_lag > 0 && expected >= 0)
+		ereport(LOG,
+				(errmsg("standby server has " INT64_FORMAT " bytes of WAL to replay, expected to take %.1f ms",
+						my_status.replay_lag, (double) expected / 1000.0)));
+	else if (my_status.replay_lag > 0)
+		ereport(LOG,
+				(errmsg("standby server has " INT64_FORMAT " bytes of WAL to replay at unknown rate",
+						my_status.replay_lag)));
+
+	if (my_status.replay_lag > 0 && expected >= 0 &&
+		expected <= (int64) promoter_catchup_timeout * 1000)
+	{
+		deadline = TimestampTzPlusMilliseconds(start, promoter_catchup_timeout);
+
+		while (my_status.replay_lag > 0)
+		{
+			TimestampTz	now = GetCurrentTimestamp();
+			int			rc;
+
+			if (now >= deadline)
+			{
+				ereport(LOG,
+						(errmsg("could not catch up within pg_promoter.catchup_timeout")));
+				break;
+			}
+
+			rc = WaitLatch(&MyProc->procLatch,
+						   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						   Min(PROMOTION_CHECK_INTERVAL, timeoutUntil(now, deadline)));
+			ResetLatch(&MyProc->procLatch);
+
+			/* Emergency bailout if postmaster has died */
+			if (rc & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (got_sigterm)
+				proc_exit(1);
+
+			last_replay_sample_time = 0;
+			sampleReplay(GetCurrentTimestamp());
+		}
+
+		ereport(LOG,
+				(errmsg("waited %.1f ms for replay to catch up",
+						(double) elapsedUsec(start, GetCurrentTimestamp()) / 1000.0)));
+	}
+
+	/* Remaining backlog is replayed by startup process before end of recovery */
+	expected_catchup = expectedCatchup();
+}
+
+/*
+ * recordTimeline()
+ *
+ * Record the time when the stage of fail over was reached.
+ */
+static void
+recordTimeline(TimelineStage stage, TimestampTz time)
+{
+	my_status.timeline[stage] = time;
+	publishStatus();
+}
+
+/*
+ * writeTimelineFile()
+ *
+ * Write the timeline into TIMELINE_FILENAME durably, so that it survives
+ * a crash during fail over. The file is replaced atomically.
+ */
+static void
+writeTimelineFile(void)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *fp;
+	int			i;
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, TIMELINE_FILENAME);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	if ((fp = AllocateFile(tmppath, PG_BINARY_W)) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	for (i = 0; i < NUM_TIMELINE_STAGES; i++)
+	{
+		if (my_status.timeline[i] == 0)
+			continue;
+		fprintf(fp, "%s\t%s\n", TimelineStageNames[i],
+				timestamptz_to_str(my_status.timeline[i]));
+	}
+
+	if (fflush(fp) != 0 || pg_fsync(fileno(fp)) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+		FreeFile(fp);
+		return;
+	}
+
+	if (FreeFile(fp))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	(void) durable_rename(tmppath, path, LOG);
+}
+
+/*
+ * Return the interval between heartbeats in milliseconds. If
+ * pg_promoter.heartbeat_interval is not set, pg_promoter.keepalives_time
+ * is used.
+ */
+static int
+heartbeatInterval(void)
+{
+	if (promoter_heartbeat_interval > 0)
+		return promoter_heartbeat_interval;
+
+	/* keepalives_time is capped so that this doesn't overflow */
+	return promoter_keepalives_time * 1000;
+}
+
+/*
+ * Return how long one heartbeat can take in milliseconds. If
+ * pg_promoter.heartbeat_timeout is not set, the heartbeat interval is used.
+ */
+static int
+heartbeatTimeout(void)
+{
+	if (promoter_heartbeat_timeout > 0)
+		return promoter_heartbeat_timeout;
+
+	return heartbeatInterval();
+}
+
+/*
+ * resetArrivalWindow()
+ *
+ * Initialize the history of heartbeat intervals. Since we have no history at
+ * first, we assume that heartbeats arrive at the configured interval with
+ * the standard deviation of a quarter of it, as Akka does.
+ */
+static void
+resetArrivalWindow(void)
+{
+	double		interval = heartbeatInterval();
+
+	memset(&arrival_window, 0, sizeof(ArrivalWindow));
+	arrival_window.intervals[0] = interval - interval / 4;
+	arrival_window.intervals[1] = interval + interval / 4;
+	arrival_window.nintervals = 2;
+	arrival_window.next = 2;
+}
+
+/*
+ * recordArrival()
+ *
+ * Add the interval between two successful heartbeats to the history.
+ */
+static void
+recordArrival(TimestampTz prev, TimestampTz now)
+{
+	arrival_window.intervals[arrival_window.next] =
+		(double) elapsedUsec(prev, now) / 1000.0;
+	arrival_window.next = (arrival_window.next + 1) % PHI_WINDOW_SIZE;
+	if (arrival_window.nintervals < PHI_WINDOW_SIZE)
+		arrival_window.nintervals++;
+}
+
+/*
+ * computePhi()
+ *
+ * Compute suspicion level of phi accrual failure detector, that is,
+ * -log10 of the probability that a heartbeat arrives later than now,
+ * assuming that intervals are normally distributed. We use the logistic
+ * approximation of the cumulative distribution function, as Akka and
+ * Cassandra do.
+ */
+static double
+computePhi(TimestampTz now)
+{
+	double		elapsed = (double) elapsedUsec(last_success_time, now) / 1000.0;
+	double		mean = 0;
+	double		variance = 0;
+	double		stddev;
+	double		y;
+	double		e;
+	int			i;
+
+	for (i = 0; i < arrival_window.nintervals; i++)
+		mean += arrival_window.intervals[i];
+	mean /= arrival_window.nintervals;
+
+	for (i = 0; i < arrival_window.nintervals; i++)
+		variance += (arrival_window.intervals[i] - mean) *
+			(arrival_window.intervals[i] - mean);
+	variance /= arrival_window.nintervals;
+
+	/* Too small deviation makes the detector oversensitive to jitters */
+	stddev = Max(sqrt(variance), (double) promoter_phi_min_stddev);
+
+	y = (elapsed - mean) / stddev;
+	e = exp(-y * (1.5976 + 0.070566 * y * y));
+
+	if (elapsed > mean)
+		return -log10(e / (1.0 + e));
+	else
+		return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+/*
+ * failureSuspected()
+ *
+ * Return true if the failure detector regards primary server as dead.
+ */
+static bool
+failureSuspected(TimestampTz now)
+{
+	switch (promoter_failure_detector)
+	{
+		case DETECTOR_COUNT:
+			return retry_count >= promoter_keepalives_count;
+
+		case DETECTOR_PHI:
+			my_status.phi = computePhi(now);
+			publishStatus();
+			return my_status.phi >= promoter_phi_threshold;
+	}
+
+	return false;
+}
+
+/*
+ * Compute how long we can sleep until the given time, in milliseconds.
+ */
+static long
+timeoutUntil(TimestampTz now, TimestampTz until)
+{
+	long		secs;
+	int			usecs;
+
+	TimestampDifference(now, until, &secs, &usecs);
+
+	/* Round up so that we don't wake up just before the time */
+	return secs * 1000L + (usecs + 999) / 1000;
+}
+
+/*
+ * probeDeadline()
+ *
+ * Return the time on the monotonic clock when the query in progress on the
+ * connection fails. Besides the deadline of the whole query, the connection
+ * and the query have their own deadlines, so that a black-holed host doesn't
+ * hold a heartbeat or a peer until the kernel gives up. The deadline of the
+ * whole heartbeat counts from its slot rather than its actual start, so that
+ * by default it falls exactly on the next slot. Peers must answer within
+ * pg_promoter.witness_timeout, and a snapshot for prewarm must be taken
+ * before the next one is due. The query for the snapshot may take long
+ * legitimately, so query_timeout doesn't apply to it.
+ */
+static int64
+probeDeadline(ProbeConn *probe)
+{
+	int64		deadline;
+
+	if (probe->is_heartbeat)
+		deadline = probe_slot_usec + (int64) heartbeatTimeout() * 1000;
+	else if (probe == &prewarm_probe)
+		deadline = probe->start_usec +
+			(int64) promoter_prewarm_interval * 1000000;
+	else
+		deadline = probe->start_usec + (int64) promoter_witness_timeout * 1000;
+
+	if (probe->state == PROBE_CONNECTING && promoter_connect_timeout > 0)
+		deadline = Min(deadline,
+					   probe->start_usec + (int64) promoter_connect_timeout * 1000);
+	else if ((probe->state == PROBE_FLUSHING || probe->state == PROBE_BUSY) &&
+			 promoter_query_timeout > 0 && probe != &prewarm_probe)
+		deadline = Min(deadline,
+					   probe->query_start_usec + (int64) promoter_query_timeout * 1000);
+
+	return deadline;
+}
+
+/*
+ * skipOverrunSlots()
+ *
+ * Skip heartbeat slots which already passed, counting them as overruns.
+ */
+static void
+skipOverrunSlots(int64 now_usec)
+{
+	int64		interval = (int64) heartbeatInterval() * 1000;
+	int64		missed;
+
+	if (now_usec < next_probe_usec)
+		return;
+
+	missed = (now_usec - next_probe_usec) / interval + 1;
+	next_probe_usec += missed * interval;
+
+	my_status.overruns += missed;
+	publishStatus();
+
+	ereport(LOG,
+			(errmsg("heartbeat overran " INT64_FORMAT " slot(s) of %d ms",
+					missed, heartbeatInterval())));
+}
+
+/*
+ * Main routine of pg_promoter.
+ */
+void
+PromoterMain(Datum main_arg)
+{
+	setupPromoter();
+		
+	/* Establish signal handlers before unblocking signals */
+	pqsignal(SIGHUP, pg_promoter_sighup);
+	pqsignal(SIGTERM, pg_promoter_sigterm);
+	pqsignal(SIGCHLD, SIG_DFL);
+	
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Read the heartbeat table through a connection, which needs hot_standby */
+	if (promoter_heartbeat_table_interval > 0)
+		BackgroundWorkerInitializeConnection(promoter_database, NULL);
+
+	/*
+	 * Main loop: do this until the SIGTERM handler tells us to terminate
+	 */
+	while (!got_sigterm)
+	{
+		HeartbeatResult	result = HEARTBEAT_PENDING;
+		ConfirmationResult confirmation = CONFIRMATION_PENDING;
+		bool			winner_promoted = false;
+		TimestampTz		now;
+		TimestampTz		deadline;
+		int64			now_usec;
+		int64			wakeup_usec;
+		WaitEventSet   *set;
+		WaitEvent		occurred[MAX_PROBE_PATHS + MAX_WITNESSES + 3];
+		int				nevents;
+		int				i;
+
+		/*
+		 * While the heartbeat is in progress, sleep until either any socket
+		 * becomes ready or the heartbeat times out. Otherwise sleep until the
+		 * next heartbeat. Heartbeats are scheduled on the monotonic clock, so
+		 * that wall clock adjustments don't shift them. Queries to peers and
+		 * for prewarm time out as well.
+		 */
+		now_usec = monotonicUsec();
+		wakeup_usec = next_probe_usec;
+		for (i = 0; i < nprobe_paths; i++)
+		{
+			if (probe_paths[i].state != PROBE_IDLE)
+				wakeup_usec = Min(wakeup_usec, probeDeadline(&probe_paths[i]));
+		}
+		for (i = 0; i < nwitnesses; i++)
+		{
+			if (witnesses[i].state != PROBE_IDLE)
+				wakeup_usec = Min(wakeup_usec, probeDeadline(&witnesses[i]));
+		}
+		if (prewarm_probe.state != PROBE_IDLE)
+			wakeup_usec = Min(wakeup_usec, probeDeadline(&prewarm_probe));
+		deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+											   wakeup_usec > now_usec ?
+											   (wakeup_usec - now_usec + 999) / 1000 : 0);
+
+		/* Wake up as well to read the heartbeat table */
+		if (promoter_heartbeat_table_interval > 0 &&
+			next_beat_sample_time < deadline)
+			deadline = next_beat_sample_time;
+
+		/* Wake up as well to read WAL, at once if we stopped halfway */
+		if (promoter_wal_message_timeout > 0)
+		{
+			if (wal_read_behind)
+				deadline = GetCurrentTimestamp();
+			else if (next_wal_read_time < deadline)
+				deadline = next_wal_read_time;
+		}
+
+		/* Wake up as well when we run out of the failover budget */
+		if (promoter_failover_timeout > 0)
+		{
+			TimestampTz	budget_end;
+
+			budget_end = TimestampTzPlusMilliseconds(last_success_time,
+													 promoter_failover_timeout);
+			if (budget_end < deadline)
+				deadline = budget_end;
+		}
+
+		/* Check the winner of the election periodically */
+		if (following)
+		{
+			if (next_winner_check_time < deadline)
+				deadline = next_winner_check_time;
+			if (follow_end_time < deadline)
+				deadline = follow_end_time;
+		}
+
+		/* Don't wait for peer standbys beyond the deadline */
+		if (confirming)
+		{
+			TimestampTz	confirm_end;
+
+			confirm_end = TimestampTzPlusMilliseconds(confirm_start_time,
+													  promoter_witness_timeout);
+			if (confirm_end < deadline)
+				deadline = confirm_end;
+		}
+
+		set = CreateWaitEventSet(CurrentMemoryContext,
+								 nprobe_paths + nwitnesses + 3);
+		AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET,
+						  &MyProc->procLatch, NULL);
+		AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET,
+						  NULL, NULL);
+		for (i = 0; i < nprobe_paths; i++)
+		{
+			ProbeConn  *path = &probe_paths[i];
+
+			if (path->state != PROBE_IDLE)
+				AddWaitEventToSet(set, path->wait_events, probeSocket(path),
+								  NULL, path);
+			else if (path->conn != NULL)
+			{
+				/* Watch the kept connection to notice its loss at once */
+				AddWaitEventToSet(set, WL_SOCKET_READABLE, probeSocket(path),
+								  NULL, path);
+			}
+		}
+		for (i = 0; i < nwitnesses; i++)
+		{
+			ProbeConn  *witness = &witnesses[i];
+
+			if (witness->state != PROBE_IDLE)
+				AddWaitEventToSet(set, witness->wait_events,
+								  probeSocket(witness), NULL, witness);
+		}
+		if (prewarm_probe.state != PROBE_IDLE)
+			AddWaitEventToSet(set, prewarm_probe.wait_events,
+							  probeSocket(&prewarm_probe), NULL, &prewarm_probe);
+
+		/*
+		 * Background workers mustn't call usleep() or any direct equivalent:
+		 * instead, they may wait on their process latch, which sleeps as
+		 * necessary, but is awakened if postmaster dies.  That way the
+		 * background process goes away immediately in an emergency.
+		 */
+		nevents = WaitEventSetWait(set,
+								   timeoutUntil(GetCurrentTimestamp(), deadline),
+								   occurred, lengthof(occurred));
+		FreeWaitEventSet(set);
+
+		for (i = 0; i < nevents; i++)
+		{
+			WaitEvent  *event = &occurred[i];
+
+			/* Emergency bailout if postmaster has died */
+			if (event->events & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (event->events & WL_LATCH_SET)
+				ResetLatch(&MyProc->procLatch);
+
+			/* Advance the query on the connection whose socket is ready */
+			if (event->events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE))
+			{
+				ProbeConn  *probe = (ProbeConn *) event->user_data;
+				HeartbeatResult r;
+
+				/* The kept connection to primary server got something */
+				if (probe->state == PROBE_IDLE)
+				{
+					if (probe->conn != NULL && !checkIdlePath(probe))
+					{
+						/* Verify it by a heartbeat through all paths now */
+						connection_lost = true;
+						if (npending_paths == 0)
+							next_probe_usec = monotonicUsec();
+					}
+					continue;
+				}
+
+				if ((r = advanceProbe(probe)) == HEARTBEAT_PENDING)
+					continue;
+
+				if (probe == &prewarm_probe)
+					finishPrewarmSnapshot(r);
+				else if (following && probe == &witnesses[winner_index])
+					winner_promoted = finishFollowing(r);
+				else if (probe >= witnesses && probe < witnesses + MAX_WITNESSES)
+				{
+					ConfirmationResult c;
+
+					if ((c = finishWitness(probe, r)) != CONFIRMATION_PENDING)
+						confirmation = c;
+				}
+				else if ((r = finishPath(probe - probe_paths, r)) != HEARTBEAT_PENDING)
+					result = r;
+			}
+		}
+
+		/*
+		 * The winner of the election has been promoted. Results of the old
+		 * primary server which arrived in the same wait are meaningless now.
+		 */
+		if (winner_promoted)
+		{
+			retargetPrimary();
+			result = HEARTBEAT_PENDING;
+		}
+
+		/* If got SIGHUP, reload the configuration file */
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		now = GetCurrentTimestamp();
+		sampleReplay(now);
+		sampleHeartbeatTable(now);
+		readWalMessages(now);
+
+		/*
+		 * Do heartbeat connection to master server. Time out paths which
+		 * didn't respond first, so that the heartbeat whose deadline falls
+		 * on the next slot doesn't push the next heartbeat aside.
+		 */
+		now_usec = monotonicUsec();
+		if (npending_paths > 0)
+		{
+			for (i = 0; i < nprobe_paths; i++)
+			{
+				ProbeConn  *path = &probe_paths[i];
+				HeartbeatResult r;
+
+				if (path->state == PROBE_IDLE ||
+					now_usec < probeDeadline(path))
+					continue;
+
+				ereport(LOG,
+						(errmsg("heartbeat to %s timed out during %s",
+								path->name,
+								path->phase != PROBE_PHASE_NONE ?
+								ProbePhaseNames[path->phase] : "start")));
+				disconnectProbe(path);
+				if ((r = finishPath(i, HEARTBEAT_FAILED)) != HEARTBEAT_PENDING)
+					result = r;
+			}
+		}
+
+		if (npending_paths == 0)
+		{
+			/*
+			 * Start a new heartbeat if it's time to do. The result of the
+			 * last heartbeat is handled first, if any; then we come back
+			 * without sleeping since the slot is still due. The next slot is
+			 * counted from this slot rather than from now, so that the
+			 * interval doesn't stretch.
+			 */
+			if (now_usec >= next_probe_usec && result == HEARTBEAT_PENDING)
+			{
+				next_probe_usec += (int64) heartbeatInterval() * 1000;
+				skipOverrunSlots(now_usec);
+				probe_slot_usec = next_probe_usec -
+					(int64) heartbeatInterval() * 1000;
+				result = startHeartbeat();
+			}
+		}
+		else
+		{
+			/*
+			 * A slot came while the heartbeat is still within its deadline.
+			 * Skip it rather than piling up heartbeats.
+			 */
+			skipOverrunSlots(now_usec);
+		}
+
+		/* Fail queries to peers and for prewarm at their deadlines */
+		for (i = 0; i < nwitnesses; i++)
+		{
+			ProbeConn  *witness = &witnesses[i];
+			ConfirmationResult c;
+
+			if (witness->state == PROBE_IDLE ||
+				now_usec < probeDeadline(witness))
+				continue;
+
+			ereport(LOG,
+					(errmsg("%s did not respond in time during %s",
+							witness->name,
+							witness->phase != PROBE_PHASE_NONE ?
+							ProbePhaseNames[witness->phase] : "start")));
+			disconnectProbe(witness);
+			if (following && i == winner_index)
+				(void) finishFollowing(HEARTBEAT_FAILED);
+			else if ((c = finishWitness(witness, HEARTBEAT_FAILED)) != CONFIRMATION_PENDING)
+				confirmation = c;
+		}
+		if (prewarm_probe.state != PROBE_IDLE &&
+			now_usec >= probeDeadline(&prewarm_probe))
+		{
+			ereport(LOG,
+					(errmsg("%s did not respond in time during %s",
+							prewarm_probe.name,
+							prewarm_probe.phase != PROBE_PHASE_NONE ?
+							ProbePhaseNames[prewarm_probe.phase] : "start")));
+			disconnectProbe(&prewarm_probe);
+			finishPrewarmSnapshot(HEARTBEAT_FAILED);
+		}
+
+		/*
+		 * If heartbeat is failed, increment retry_count. Once primary server
+		 * responded, start counting from scratch.
+		 */
+		if (result == HEARTBEAT_FAILED)
+		{
+			retry_count++;
+
+			if (my_status.timeline[TIMELINE_FIRST_FAILURE] == 0)
+				my_status.timeline[TIMELINE_FIRST_FAILURE] = now;
+
+			ereport(LOG,
+					(errmsg("could not get response from primary server through any path at %d time(s)",
+							retry_count)));
+
+			my_status.state = PROMOTER_STATE_SUSPECT;
+			my_status.consecutive_failures = retry_count;
+			publishStatus();
+		}
+		else if (result == HEARTBEAT_SUCCEEDED)
+		{
+			if (my_status.last_success_time != 0)
+				recordArrival(last_success_time, now);
+
+			retry_count = 0;
+			last_success_time = now;
+			connection_lost = false;
+
+			my_status.timeline[TIMELINE_FIRST_FAILURE] = 0;
+
+			my_status.state = PROMOTER_STATE_HEALTHY;
+			my_status.last_success_time = now;
+			my_status.last_rtt = elapsedUsec(probe_start_time, now);
+			my_status.consecutive_failures = 0;
+			publishStatus();
+		}
+
+		/* Take a snapshot of hot blocks periodically while primary is alive */
+		if (promoter_prewarm_interval > 0 && result == HEARTBEAT_SUCCEEDED &&
+			now >= next_prewarm_time && prewarm_probe.state == PROBE_IDLE)
+		{
+			next_prewarm_time = TimestampTzPlusMilliseconds(now,
+															promoter_prewarm_interval * 1000L);
+			startPrewarmSnapshot();
+		}
+
+		/*
+		 * Primary server came back while asking peer standbys, so the
+		 * confirmation is no longer needed.
+		 */
+		if (confirming && result == HEARTBEAT_SUCCEEDED)
+		{
+			ereport(LOG,
+					(errmsg("primary server responded during confirmation")));
+			cancelConfirmation();
+		}
+
+		/*
+		 * While following the winner of the election, check whether it has
+		 * been promoted. If it isn't within pg_promoter.election_timeout,
+		 * or primary server came back, give up following it.
+		 */
+		if (following)
+		{
+			ProbeConn  *winner = &witnesses[winner_index];
+
+			if (result == HEARTBEAT_SUCCEEDED)
+			{
+				ereport(LOG,
+						(errmsg("primary server responded while waiting for %s to promote",
+								winner->name)));
+				following = false;
+			}
+			else if (now >= follow_end_time)
+			{
+				ereport(LOG,
+						(errmsg("%s was not promoted within pg_promoter.election_timeout",
+								winner->name)));
+				following = false;
+				next_confirm_time = now;
+				my_status.state = PROMOTER_STATE_SUSPECT;
+				publishStatus();
+			}
+			else if (now >= next_winner_check_time && winner->state == PROBE_IDLE)
+			{
+				HeartbeatResult r;
+
+				next_winner_check_time = TimestampTzPlusMilliseconds(now,
+																	 heartbeatInterval());
+				if ((r = startProbe(winner, WINNER_SQL)) != HEARTBEAT_PENDING &&
+					finishFollowing(r))
+					retargetPrimary();
+			}
+		}
+
+		/* If the failure detector suspects primary server, or primary
+		 * server didn't respond within pg_promoter.failover_timeout, do
+		 * promote the standby server to master server, and exit. If peer
+		 * standbys are configured, ask them before promoting. A lost
+		 * connection which the verifying heartbeat couldn't restore goes to
+		 * peers at once, but alone it's no reason to promote, e.g. primary
+		 * server may be just restarting.
+		 */
+		if (!confirming && !following && now >= next_confirm_time &&
+			((connection_lost && retry_count > 0 && nwitnesses > 0) ||
+			 failureSuspected(now) ||
+			 (promoter_failover_timeout > 0 &&
+			  TimestampDifferenceExceeds(last_success_time, now,
+										 promoter_failover_timeout))))
+		{
+			if (nwitnesses == 0)
+			{
+				decidePromotion(now);
+
+				/* Fencing failed, try again after the next heartbeat */
+				next_confirm_time = TimestampTzPlusMilliseconds(now,
+																heartbeatInterval());
+			}
+			else
+				startConfirmation();
+		}
+
+		/* Check the answers from peer standbys */
+		if (confirming)
+		{
+			if (confirmation == CONFIRMATION_PENDING)
+			{
+				bool		timedout;
+
+				timedout = TimestampDifferenceExceeds(confirm_start_time,
+													  GetCurrentTimestamp(),
+													  promoter_witness_timeout);
+
+				/* Peers which didn't answer in time don't run for election */
+				if (nagreed_witnesses >= promoter_witness_quorum &&
+					(!promoter_election || npending_witnesses == 0 || timedout))
+					confirmation = CONFIRMATION_ACCEPTED;
+				else if (nagreed_witnesses + npending_witnesses < promoter_witness_quorum ||
+						 timedout)
+					confirmation = CONFIRMATION_REJECTED;
+			}
+
+			if (confirmation == CONFIRMATION_ACCEPTED)
+			{
+				int			winner = -1;
+
+				ereport(LOG,
+						(errmsg("%d peer server(s) confirmed failure of primary server",
+								nagreed_witnesses)));
+
+				if (!promoter_election || (winner = electWinner()) == -1)
+				{
+					decidePromotion(now);
+
+					/* Fencing failed, ask again after the next heartbeat */
+					cancelConfirmation();
+					next_confirm_time = TimestampTzPlusMilliseconds(now,
+																	heartbeatInterval());
+				}
+				else if (winner >= 0)
+				{
+					cancelConfirmation();
+					ereport(LOG,
+							(errmsg("%s won the election, waiting for it to promote",
+									witnesses[winner].name),
+							 errdetail("It received WAL up to %X/%X and has priority %d.",
+									   (uint32) (candidates[winner].received >> 32),
+									   (uint32) candidates[winner].received,
+									   candidates[winner].priority)));
+					startFollowing(winner, now);
+				}
+				else
+				{
+					/* Nobody was elected, ask again after next heartbeat */
+					cancelConfirmation();
+					next_confirm_time = TimestampTzPlusMilliseconds(now,
+																	heartbeatInterval());
+					my_status.state = PROMOTER_STATE_SUSPECT;
+					publishStatus();
+				}
+			}
+			else if (confirmation == CONFIRMATION_REJECTED)
+			{
+				ereport(LOG,
+						(errmsg("failure of primary server was not confirmed by peer servers"),
+						 errdetail("%d peer server(s) agreed, but %d required.",
+								   nagreed_witnesses, promoter_witness_quorum)));
+				cancelConfirmation();
+
+				/* Ask again after the next heartbeat */
+				next_confirm_time = TimestampTzPlusMilliseconds(now,
+																heartbeatInterval());
+				my_status.state = PROMOTER_STATE_SUSPECT;
+				publishStatus();
+			}
+		}
+	}
+
+	proc_exit(1);
+}
+
+/*
+ * doPromote()
+ *
+ * Promote standby server using ordinally way which is used by
+ * pg_ctl client tool. Put trigger file into $PGDATA, and send
+ * SIGUSR1 signal to standby server.
+ */
+static void
+doPromote(void)
+{
+	char trigger_filepath[MAXPGPATH];
+	FILE *fp;
+
+    snprintf(trigger_filepath, 1000, "%s/promote", DataDir);
+
+	if ((fp = fopen(trigger_filepath, "w")) == NULL)
+	{
+		ereport(LOG,
+				(errmsg("could not create promote file: \"%s\"", trigger_filepath)));
+		proc_exit(1);
+	}
+
+	if (fclose(fp))
+	{
+		ereport(LOG,
+				(errmsg("could not close promote file: \"%s\"", trigger_filepath)));
+		proc_exit(1);
+	}
+
+	recordTimeline(TIMELINE_TRIGGER, GetCurrentTimestamp());
+
+	ereport(LOG,
+			(errmsg("promote standby server to primary server")));
+
+	/* Do promote */
+	if (kill(PostmasterPid, SIGUSR1) != 0)
+	{
+		ereport(LOG,
+				(errmsg("failed to send SIGUSR1 signal to postmaster process : %d",
+						PostmasterPid)));
+		proc_exit(1);
+	}
+
+	recordTimeline(TIMELINE_SIGNAL, GetCurrentTimestamp());
+}
+
+/*
+ * startPrewarmSnapshot()
+ *
+ * Ask primary server for the list of hot blocks in its shared buffers, unless
+ * the previous snapshot is still being loaded.
+ */
+static void
+startPrewarmSnapshot(void)
+{
+	HeartbeatResult r;
+	pid_t		pid;
+
+	if (prewarm_worker != NULL &&
+		GetBackgroundWorkerPid(prewarm_worker, &pid) != BGWH_STOPPED)
+		return;
+
+	snprintf(prewarm_query, sizeof(prewarm_query), PREWARM_SQL,
+			 promoter_prewarm_blocks);
+
+	if ((r = startProbe(&prewarm_probe, prewarm_query)) != HEARTBEAT_PENDING)
+		finishPrewarmSnapshot(r);
+}
+
+/*
+ * finishPrewarmSnapshot()
+ *
+ * Dump the snapshot of hot blocks, and launch a worker to load them.
+ */
+static void
+finishPrewarmSnapshot(HeartbeatResult result)
+{
+	BackgroundWorker worker;
+
+	if (result != HEARTBEAT_SUCCEEDED || prewarm_probe.result == NULL)
+		return;
+
+	if (!dumpPrewarmBlocks(prewarm_probe.result))
+		return;
+
+	PQclear(prewarm_probe.result);
+	prewarm_probe.result = NULL;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	worker.bgw_main = NULL;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_promoter");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "PromoterPrewarmMain");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_promoter prewarm");
+	worker.bgw_main_arg = (Datum) 0;
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &prewarm_worker))
+	{
+		ereport(LOG,
+				(errmsg("could not register background process for prewarm"),
+				 errhint("You may need to increase max_worker_processes.")));
+		prewarm_worker = NULL;
+	}
+}
+
+/*
+ * dumpPrewarmBlocks()
+ *
+ * Write the snapshot of hot blocks into PREWARM_FILENAME, in the similar
+ * format to pg_prewarm's autoprewarm.blocks: the number of blocks, followed
+ * by database, tablespace, relfilenode, fork and block number of each block.
+ */
+static bool
+dumpPrewarmBlocks(PGresult *res)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *fp;
+	int			i;
+
+	if (PQnfields(res) != 5)
+	{
+		ereport(LOG,
+				(errmsg("unexpected snapshot of hot blocks from primary server")));
+		return false;
+	}
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, PREWARM_FILENAME);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	if ((fp = AllocateFile(tmppath, PG_BINARY_W)) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return false;
+	}
+
+	fprintf(fp, "<<%d>>\n", PQntuples(res));
+	for (i = 0; i < PQntuples(res); i++)
+		fprintf(fp, "%s,%s,%s,%s,%s\n",
+				PQgetvalue(res, i, 0), PQgetvalue(res, i, 1),
+				PQgetvalue(res, i, 2), PQgetvalue(res, i, 3),
+				PQgetvalue(res, i, 4));
+
+	if (FreeFile(fp))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+		return false;
+	}
+
+	if (rename(tmppath, path) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						tmppath, path)));
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Main routine of the prewarm worker.
+ *
+ * Load blocks listed in PREWARM_FILENAME into shared buffers. Relfilenodes
+ * are the same on primary and standby server, so we can read them without
+ * relcache. Blocks which don't exist on standby server, e.g. of unlogged
+ * relations or beyond the end of relations truncated since the snapshot,
+ * are skipped.
+ */
+void
+PromoterPrewarmMain(Datum main_arg)
+{
+	char		path[MAXPGPATH];
+	FILE	   *fp;
+	int			nblocks = 0;
+	int			nloaded = 0;
+	RelFileNode	rnode;
+	RelFileNode	prev_rnode;
+	int			forknum;
+	int			prev_forknum = -1;
+	BlockNumber	blkno;
+	BlockNumber	rel_nblocks = 0;
+
+	/* Establish signal handlers before unblocking signals */
+	pqsignal(SIGTERM, pg_promoter_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Buffer pins need a resource owner */
+	CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_promoter prewarm");
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, PREWARM_FILENAME);
+
+	if ((fp = AllocateFile(path, PG_BINARY_R)) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+		proc_exit(1);
+	}
+
+	if (fscanf(fp, "<<%d>>\n", &nblocks) != 1)
+		ereport(ERROR,
+				(errmsg("could not read from file \"%s\"", path)));
+
+	memset(&prev_rnode, 0, sizeof(RelFileNode));
+
+	while (!got_sigterm &&
+		   fscanf(fp, "%u,%u,%u,%d,%u\n", &rnode.dbNode, &rnode.spcNode,
+				  &rnode.relNode, &forknum, &blkno) == 5)
+	{
+		Buffer		buf;
+
+		if (forknum < 0 || forknum > MAX_FORKNUM)
+			continue;
+
+		/* Get the size of the relation fork when we move to another one */
+		if (!RelFileNodeEquals(rnode, prev_rnode) || forknum != prev_forknum)
+		{
+			SMgrRelation reln = smgropen(rnode, InvalidBackendId);
+
+			if (smgrexists(reln, (ForkNumber) forknum))
+				rel_nblocks = smgrnblocks(reln, (ForkNumber) forknum);
+			else
+				rel_nblocks = 0;
+
+			prev_rnode = rnode;
+			prev_forknum = forknum;
+		}
+
+		if (blkno >= rel_nblocks)
+			continue;
+
+		buf = ReadBufferWithoutRelcache(rnode, (ForkNumber) forknum, blkno,
+										RBM_NORMAL, NULL);
+		ReleaseBuffer(buf);
+		nloaded++;
+	}
+
+	FreeFile(fp);
+
+	ereport(LOG,
+			(errmsg("pg_promoter prewarmed %d of %d hot block(s) of primary server",
+					nloaded, nblocks)));
+
+	proc_exit(0);
+}
+
+/*
+ * nextBeatTime()
+ *
+ * Advance the schedule of a kind of heartbeat by interval milliseconds.
+ * Keep a fixed rate rather than a fixed gap, and skip beats we missed
+ * rather than bursting to catch up. Return 0 if the kind is disabled.
+ */
+static TimestampTz
+nextBeatTime(TimestampTz prev, int interval, TimestampTz now)
+{
+	TimestampTz	next;
+
+	if (interval <= 0)
+		return 0;
+
+	next = TimestampTzPlusMilliseconds(prev, interval);
+	if (next <= now)
+		next = TimestampTzPlusMilliseconds(now, interval);
+
+	return next;
+}
+
+/*
+ * Main routine of the heartbeat writer.
+ *
+ * On primary server, update the row of the heartbeat table, so that standbys
+ * can tell that primary server commits writes and replication delivers them,
+ * send notifications to standbys listening on NOTIFY_CHANNEL, and embed
+ * logical messages in WAL, each at a fixed rate. This starts only once
+ * recovery finished, like the responder.
+ */
+void
+PromoterHeartbeatWriterMain(Datum main_arg)
+{
+	TimestampTz	next_beat_time;
+	TimestampTz	next_notify_time;
+	TimestampTz	next_wal_message_time;
+	StringInfoData buf;
+
+	/* Establish signal handlers before unblocking signals */
+	pqsignal(SIGHUP, pg_promoter_sighup);
+	pqsignal(SIGTERM, pg_promoter_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	/* Connect to our database */
+	BackgroundWorkerInitializeConnection(promoter_database, NULL);
+
+	initStringInfo(&buf);
+	next_beat_time = promoter_heartbeat_table_interval > 0 ?
+		GetCurrentTimestamp() : 0;
+	next_notify_time = promoter_notify_interval > 0 ?
+		GetCurrentTimestamp() : 0;
+	next_wal_message_time = promoter_wal_message_interval > 0 ?
+		GetCurrentTimestamp() : 0;
+
+	while (!got_sigterm)
+	{
+		TimestampTz	now = GetCurrentTimestamp();
+		TimestampTz	wakeup;
+		bool		beat_due = next_beat_time != 0 && now >= next_beat_time;
+		bool		notify_due = next_notify_time != 0 && now >= next_notify_time;
+		int			rc;
+
+		/*
+		 * Embed the current time in WAL as a non-transactional logical
+		 * message, and flush it so that walsender streams it at once.
+		 */
+		if (next_wal_message_time != 0 && now >= next_wal_message_time)
+		{
+			TimestampTz	sent_time = GetCurrentTimestamp();
+
+			XLogFlush(LogLogicalMessage(WAL_MESSAGE_PREFIX, (char *) &sent_time,
+										sizeof(TimestampTz), false));
+
+			next_wal_message_time = nextBeatTime(next_wal_message_time,
+												 promoter_wal_message_interval,
+												 GetCurrentTimestamp());
+		}
+
+		if (got_sighup)
+		{
+			got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (beat_due || notify_due)
+		{
+			SetCurrentStatementStartTimestamp();
+			StartTransactionCommand();
+			SPI_connect();
+			PushActiveSnapshot(GetTransactionSnapshot());
+			pgstat_report_activity(STATE_RUNNING, "writing heartbeat");
+
+			if (beat_due &&
+				(heartbeat_table.schema != NULL || lookupHeartbeatTable()))
+			{
+				resetStringInfo(&buf);
+				appendStringInfo(&buf,
+								 "update %s.%s set beat_time = clock_timestamp() where id = 1",
+								 quote_identifier(heartbeat_table.schema),
+								 quote_identifier(heartbeat_table.name));
+
+				if (SPI_execute(buf.data, false, 0) != SPI_OK_UPDATE)
+					elog(FATAL, "cannot update heartbeat table");
+			}
+
+			/* Notifications are delivered when we commit */
+			if (notify_due &&
+				SPI_execute("select pg_notify('" NOTIFY_CHANNEL "', clock_timestamp()::text)",
+							false, 0) != SPI_OK_SELECT)
+				elog(FATAL, "cannot send notification");
+
+			SPI_finish();
+			PopActiveSnapshot();
+			CommitTransactionCommand();
+			pgstat_report_activity(STATE_IDLE, NULL);
+
+			now = GetCurrentTimestamp();
+			if (beat_due)
+				next_beat_time = nextBeatTime(next_beat_time,
+											  promoter_heartbeat_table_interval,
+											  now);
+			if (notify_due)
+				next_notify_time = nextBeatTime(next_notify_time,
+												promoter_notify_interval,
+												now);
+		}
+
+		wakeup = next_beat_time;
+		if (wakeup == 0 || (next_notify_time != 0 && next_notify_time < wakeup))
+			wakeup = next_notify_time;
+		if (wakeup == 0 ||
+			(next_wal_message_time != 0 && next_wal_message_time < wakeup))
+			wakeup = next_wal_message_time;
+
+		rc = WaitLatch(&MyProc->procLatch,
+					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					   timeoutUntil(now, wakeup));
+		ResetLatch(&MyProc->procLatch);
+
+		/* Emergency bailout if postmaster has died */
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * Main routine of the responder.
+ *
+ * Answer heartbeats from standbys by UDP, from its own event loop, so that
+ * standbys can poll primary server frequently without consuming connection
+ * slots or forking backends. This starts only once recovery finished, i.e.
+ * only on primary server, including a standby server after promotion.
+ */
+void
+PromoterResponderMain(Datum main_arg)
+{
+	pgsocket	socks[MAX_RESPONDER_SOCKETS];
+	int			nsocks = 0;
+	struct addrinfo hints;
+	struct addrinfo *addrs;
+	struct addrinfo *addr;
+	char		portstr[16];
+	WaitEventSet *set;
+	int			ret;
+	int			i;
+
+	/* Establish signal handlers before unblocking signals */
+	pqsignal(SIGTERM, pg_promoter_sigterm);
+
+	/* We're now ready to receive signals */
+	BackgroundWorkerUnblockSignals();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(portstr, sizeof(portstr), "%d", promoter_responder_port);
+
+	if ((ret = getaddrinfo(NULL, portstr, &hints, &addrs)) != 0)
+		ereport(ERROR,
+				(errmsg("could not resolve address for responder: %s",
+						gai_strerror(ret))));
+
+	for (addr = addrs; addr != NULL && nsocks < MAX_RESPONDER_SOCKETS;
+		 addr = addr->ai_next)
+	{
+		pgsocket	sock;
+		int			one = 1;
+
+		if ((sock = socket(addr->ai_family, SOCK_DGRAM, 0)) == PGINVALID_SOCKET)
+			continue;
+
+#ifdef IPV6_V6ONLY
+		/* Don't conflict with the IPv4 socket */
+		if (addr->ai_family == AF_INET6)
+			(void) setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY,
+							  (char *) &one, sizeof(one));
+#endif
+
+		if (bind(sock, addr->ai_addr, addr->ai_addrlen) < 0 ||
+			!pg_set_noblock(sock))
+		{
+			ereport(LOG,
+					(errcode_for_socket_access(),
+					 errmsg("could not bind UDP port %d for responder: %m",
+							promoter_responder_port)));
+			closesocket(sock);
+			continue;
+		}
+
+		socks[nsocks++] = sock;
+	}
+	freeaddrinfo(addrs);
+
+	if (nsocks == 0)
+		ereport(ERROR,
+				(errmsg("could not create any socket for responder")));
+
+	ereport(LOG,
+			(errmsg("pg_promoter responder listening on UDP port %d",
+					promoter_responder_port)));
+
+	set = CreateWaitEventSet(CurrentMemoryContext, nsocks + 2);
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET,
+					  &MyProc->procLatch, NULL);
+	AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	for (i = 0; i < nsocks; i++)
+		AddWaitEventToSet(set, WL_SOCKET_READABLE, socks[i], NULL, NULL);
+
+	while (!got_sigterm)
+	{
+		WaitEvent	occurred[MAX_RESPONDER_SOCKETS + 2];
+		int			nevents;
+
+		nevents = WaitEventSetWait(set, -1, occurred, lengthof(occurred));
+
+		for (i = 0; i < nevents; i++)
+		{
+			WaitEvent  *event = &occurred[i];
+
+			/* Emergency bailout if postmaster has died */
+			if (event->events & WL_POSTMASTER_DEATH)
+				proc_exit(1);
+
+			if (event->events & WL_LATCH_SET)
+				ResetLatch(&MyProc->procLatch);
+
+			if (event->events & WL_SOCKET_READABLE)
+				answerHeartbeats(event->fd);
+		}
+	}
+
+	proc_exit(0);
+}
+
+/*
+ * answerHeartbeats()
+ *
+ * Answer all heartbeats queued on the socket. Malformed packets are ignored,
+ * and replies are dropped rather than blocking if the socket buffer is full.
+ */
+static void
+answerHeartbeats(pgsocket sock)
+{
+	for (;;)
+	{
+		HeartbeatPacket packet;
+		struct sockaddr_storage from;
+		socklen_t	fromlen = sizeof(from);
+		ssize_t		len;
+
+		len = recvfrom(sock, &packet, sizeof(packet), 0,
+					   (struct sockaddr *) &from, &fromlen);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ereport(LOG,
+						(errcode_for_socket_access(),
+						 errmsg("could not receive heartbeat: %m")));
+			return;
+		}
+
+		if (len != sizeof(packet) ||
+			memcmp(packet.magic, RESPONDER_REQUEST_MAGIC, sizeof(packet.magic)) != 0)
+			continue;
+
+		memcpy(packet.magic, RESPONDER_REPLY_MAGIC, sizeof(packet.magic));
+		(void) sendto(sock, &packet, sizeof(packet), 0,
+					  (struct sockaddr *) &from, fromlen);
+	}
+}
+
+/*
+ * pg_promoter_status()
+ *
+ * Return the status of the worker. This doesn't take any lock, so it's cheap
+ * enough to be called by monitoring tools very frequently.
+ */
+Datum
+pg_promoter_status(PG_FUNCTION_ARGS)
+{
+#define PG_PROMOTER_STATUS_COLS 14
+	TupleDesc	tupdesc;
+	PromoterStatus status;
+	Datum		values[PG_PROMOTER_STATUS_COLS];
+	bool		nulls[PG_PROMOTER_STATUS_COLS];
+	int			i = 0;
+
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	readStatus(&status);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	if (status.pid != 0)
+		values[i++] = Int32GetDatum(status.pid);
+	else
+		nulls[i++] = true;
+	values[i++] = CStringGetTextDatum(PromoterStateNames[status.state]);
+	if (status.last_probe_time != 0)
+		values[i++] = TimestampTzGetDatum(status.last_probe_time);
+	else
+		nulls[i++] = true;
+	if (status.last_success_time != 0)
+		values[i++] = TimestampTzGetDatum(status.last_success_time);
+	else
+		nulls[i++] = true;
+	if (status.last_success_time != 0)
+		values[i++] = Float8GetDatum((double) status.last_rtt / 1000.0);
+	else
+		nulls[i++] = true;
+	values[i++] = Int32GetDatum(status.consecutive_failures);
+	values[i++] = Float8GetDatum(status.phi);
+	if (status.last_stream_time != 0)
+		values[i++] = TimestampTzGetDatum(status.last_stream_time);
+	else
+		nulls[i++] = true;
+	if (status.decision_time != 0)
+		values[i++] = TimestampTzGetDatum(status.decision_time);
+	else
+		nulls[i++] = true;
+	values[i++] = Int64GetDatum(status.replay_lag);
+	values[i++] = Float8GetDatum(status.replay_rate);
+	if (status.last_beat_time != 0)
+	{
+		values[i++] = TimestampTzGetDatum(status.last_beat_time);
+		values[i++] = Float8GetDatum((double) status.replication_latency / 1000.0);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+	values[i++] = Int64GetDatum(status.overruns);
+
+	Assert(i == PG_PROMOTER_STATUS_COLS);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * beginMaterializedSRF()
+ *
+ * Check that the caller of the set-returning function accepts a tuplestore,
+ * and set up an empty one in the per-query memory context. The tuplestore
+ * and the tuple descriptor of the result type are returned.
+ */
+static Tuplestorestate *
+beginMaterializedSRF(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+
+	/* check to see if caller supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not " \
+						"allowed in this context")));
+
+	/* Build a tuple descriptor for our result type */
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+/*
+ * pg_promoter_paths()
+ *
+ * Return the status of each path to primary server, in the order specified
+ * in pg_promoter.primary_conninfo.
+ */
+Datum
+pg_promoter_paths(PG_FUNCTION_ARGS)
+{
+#define PG_PROMOTER_PATHS_COLS 4
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PromoterStatus status;
+	int			pathno;
+
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	tupstore = beginMaterializedSRF(fcinfo, &tupdesc);
+
+	readStatus(&status);
+
+	for (pathno = 0; pathno < status.npaths; pathno++)
+	{
+		PathStatus *pstatus = &status.paths[pathno];
+		Datum		values[PG_PROMOTER_PATHS_COLS];
+		bool		nulls[PG_PROMOTER_PATHS_COLS];
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = Int32GetDatum(pathno + 1);
+		if (pstatus->last_success_time != 0)
+		{
+			values[i++] = TimestampTzGetDatum(pstatus->last_success_time);
+			values[i++] = Float8GetDatum((double) pstatus->last_rtt / 1000.0);
+		}
+		else
+		{
+			nulls[i++] = true;
+			nulls[i++] = true;
+		}
+		values[i++] = Int32GetDatum(pstatus->consecutive_failures);
+
+		Assert(i == PG_PROMOTER_PATHS_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_promoter_timeline()
+ *
+ * Return the timeline of fail over, one row for each stage reached so far,
+ * with the elapsed time since the first stage in milliseconds.
+ */
+Datum
+pg_promoter_timeline(PG_FUNCTION_ARGS)
+{
+#define PG_PROMOTER_TIMELINE_COLS 3
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	PromoterStatus status;
+	TimestampTz	origin = 0;
+	int			stage;
+
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	tupstore = beginMaterializedSRF(fcinfo, &tupdesc);
+
+	readStatus(&status);
+
+	for (stage = 0; stage < NUM_TIMELINE_STAGES; stage++)
+	{
+		Datum		values[PG_PROMOTER_TIMELINE_COLS];
+		bool		nulls[PG_PROMOTER_TIMELINE_COLS];
+		int			i = 0;
+
+		if (status.timeline[stage] == 0)
+			continue;
+		if (origin == 0)
+			origin = status.timeline[stage];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(TimelineStageNames[stage]);
+		values[i++] = TimestampTzGetDatum(status.timeline[stage]);
+		values[i++] = Float8GetDatum((double) elapsedUsec(origin, status.timeline[stage]) / 1000.0);
+
+		Assert(i == PG_PROMOTER_TIMELINE_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_promoter_latency()
+ *
+ * Return the summary of latency histograms, one row for each kind.
+ * Percentiles are reported as the upper bound of the bucket, in milliseconds.
+ */
+Datum
+pg_promoter_latency(PG_FUNCTION_ARGS)
+{
+#define PG_PROMOTER_LATENCY_COLS 7
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	static const double percentiles[] = {0.5, 0.99, 0.999};
+	int			kind;
+
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	tupstore = beginMaterializedSRF(fcinfo, &tupdesc);
+
+	for (kind = 0; kind < NUM_LATENCY_KINDS; kind++)
+	{
+		LatencyHistogram *hist = &promoter_shared->latency[kind];
+		uint64		buckets[LATENCY_BUCKETS];
+		uint64		total = 0;
+		uint64		sum;
+		uint64		max;
+		Datum		values[PG_PROMOTER_LATENCY_COLS];
+		bool		nulls[PG_PROMOTER_LATENCY_COLS];
+		int			i = 0;
+		int			p;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		/*
+		 * Take a snapshot of buckets. Percentiles are computed from the
+		 * snapshot, so that they are consistent with each other even if the
+		 * worker keeps recording.
+		 */
+		for (p = 0; p < LATENCY_BUCKETS; p++)
+		{
+			buckets[p] = pg_atomic_read_u64(&hist->buckets[p]);
+			total += buckets[p];
+		}
+		sum = pg_atomic_read_u64(&hist->sum);
+		max = pg_atomic_read_u64(&hist->max);
+
+		values[i++] = CStringGetTextDatum(LatencyKindNames[kind]);
+		values[i++] = Int64GetDatum((int64) total);
+
+		if (total == 0)
+		{
+			while (i < PG_PROMOTER_LATENCY_COLS)
+				nulls[i++] = true;
+		}
+		else
+		{
+			values[i++] = Float8GetDatum((double) sum / total / 1000.0);
+
+			for (p = 0; p < lengthof(percentiles); p++)
+			{
+				uint64		rank = (uint64) ceil(percentiles[p] * total);
+				uint64		seen = 0;
+				int			b;
+
+				for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+				{
+					seen += buckets[b];
+					if (seen >= rank)
+						break;
+				}
+
+				/* The bucket may be wider than the actual maximum */
+				values[i++] = Float8GetDatum((double) Min(latencyBucketUpperBound(b), max) / 1000.0);
+			}
+
+			values[i++] = Float8GetDatum((double) max / 1000.0);
+		}
+
+		Assert(i == PG_PROMOTER_LATENCY_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_promoter_phases()
+ *
+ * Return the accumulated time spent in each phase of heartbeats, in
+ * milliseconds.
+ */
+Datum
+pg_promoter_phases(PG_FUNCTION_ARGS)
+{
+#define PG_PROMOTER_PHASES_COLS 5
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	int			phase;
+
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	tupstore = beginMaterializedSRF(fcinfo, &tupdesc);
+
+	for (phase = 0; phase < NUM_PROBE_PHASES; phase++)
+	{
+		PhaseCounters *counters = &promoter_shared->phases[phase];
+		uint64		count = pg_atomic_read_u64(&counters->count);
+		uint64		sum = pg_atomic_read_u64(&counters->sum);
+		uint64		max = pg_atomic_read_u64(&counters->max);
+		Datum		values[PG_PROMOTER_PHASES_COLS];
+		bool		nulls[PG_PROMOTER_PHASES_COLS];
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[i++] = CStringGetTextDatum(ProbePhaseNames[phase]);
+		values[i++] = Int64GetDatum((int64) count);
+		values[i++] = Float8GetDatum((double) sum / 1000.0);
+		if (count > 0)
+			values[i++] = Float8GetDatum((double) sum / count / 1000.0);
+		else
+			nulls[i++] = true;
+		values[i++] = Float8GetDatum((double) max / 1000.0);
+
+		Assert(i == PG_PROMOTER_PHASES_COLS);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	/* clean up and return the tuplestore */
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * pg_promoter_latency_reset()
+ *
+ * Clear the latency histograms and phase counters.
+ */
+Datum
+pg_promoter_latency_reset(PG_FUNCTION_ARGS)
+{
+	if (promoter_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("pg_promoter must be loaded via shared_preload_libraries")));
+
+	resetLatency();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Entrypoint of this module.
+ *
+ * We register more than one worker process here, to demonstrate how that can
+ * be done.
+ */
+void
+_PG_init(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	/* get the configuration */
+	DefineCustomIntVariable("pg_promoter.keepalives_time",
+							"Specific time between polling to primary server",
+							NULL,
+							&promoter_keepalives_time,
+							5,
 							1,
-							INT_MAX,
+							INT_MAX / 1000,
 							PGC_SIGHUP,
 							0,
 							NULL,
@@ -298,9 +5018,48 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("pg_promoter.heartbeat_interval",
+							"Specific time between polling to primary server in milliseconds",
+							"-1 means to use pg_promoter.keepalives_time.",
+							&promoter_heartbeat_interval,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.heartbeat_timeout",
+							"Specific time to wait for one polling to primary server",
+							"-1 means to use the interval between pollings.",
+							&promoter_heartbeat_timeout,
+							-1,
+							-1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.failover_timeout",
+							"Specific time without successful polling until promoting standby server",
+							"0 means to promote only by pg_promoter.keepalives_count.",
+							&promoter_failover_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomStringVariable("pg_promoter.primary_conninfo",
 							"Connection information for primary server",
-							NULL,
+							"Multiple paths to primary server can be specified, separated by semicolons.",
 							&promoter_primary_conninfo,
 							"",
 							PGC_POSTMASTER,
@@ -309,6 +5068,432 @@ _PG_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomBoolVariable("pg_promoter.keep_connection",
+							 "Keep the connection to primary server between heartbeats",
+							 NULL,
+							 &promoter_keep_connection,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("pg_promoter.failure_detector",
+							 "Failure detector to decide to promote standby server",
+							 NULL,
+							 &promoter_failure_detector,
+							 DETECTOR_COUNT,
+							 detector_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomRealVariable("pg_promoter.phi_threshold",
+							 "Suspicion level to promote standby server with phi accrual failure detector",
+							 NULL,
+							 &promoter_phi_threshold,
+							 8.0,
+							 0.1,
+							 100.0,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_promoter.phi_min_stddev",
+							"Minimum standard deviation of polling intervals for phi accrual failure detector",
+							NULL,
+							&promoter_phi_min_stddev,
+							100,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_promoter.witness_conninfo",
+							"Connection information for peer standby servers",
+							"Multiple peers can be specified, separated by semicolons.",
+							&promoter_witness_conninfo,
+							"",
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.witness_quorum",
+							"Number of peer standby servers which must confirm failure of primary server",
+							NULL,
+							&promoter_witness_quorum,
+							1,
+							1,
+							MAX_WITNESSES,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.witness_timeout",
+							"Specific time to wait for peer standby servers to confirm failure",
+							NULL,
+							&promoter_witness_timeout,
+							500,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_promoter.election",
+							 "Promote only the most advanced standby server among peers",
+							 NULL,
+							 &promoter_election,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_promoter.priority",
+							"Priority of the standby server in the election",
+							"0 means never to promote.",
+							&promoter_priority,
+							100,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.election_timeout",
+							"Specific time to wait for the winner of the election to promote",
+							NULL,
+							&promoter_election_timeout,
+							30000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.walreceiver_timeout",
+							"Specific time within which a message via replication proves primary server alive",
+							"0 means to always poll primary server by query.",
+							&promoter_walreceiver_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_promoter.fence_command",
+							"Shell command to fence primary server before promotion",
+							NULL,
+							&promoter_fence_command,
+							"",
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.fence_timeout",
+							"Maximum time to wait for the fence command",
+							NULL,
+							&promoter_fence_timeout,
+							10000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_promoter.fence_policy",
+							 "What to do when fencing of primary server failed",
+							 NULL,
+							 &promoter_fence_policy,
+							 FENCE_POLICY_REQUIRED,
+							 fence_policy_options,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_promoter.post_promote_command",
+							"Shell commands to run after promotion",
+							"Multiple commands can be specified, separated by commas.",
+							&promoter_post_promote_command,
+							"",
+							PGC_SIGHUP,
+							GUC_LIST_INPUT | GUC_LIST_QUOTE,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.post_promote_timeout",
+							"Maximum time to wait for each post-promotion command",
+							NULL,
+							&promoter_post_promote_timeout,
+							5000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomEnumVariable("pg_promoter.probe_method",
+							 "How to send heartbeats to primary server",
+							 NULL,
+							 &promoter_probe_method,
+							 PROBE_METHOD_QUERY,
+							 probe_method_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_promoter.responder_port",
+							"UDP port number of the responder",
+							"0 means not to start the responder.",
+							&promoter_responder_port,
+							0,
+							0,
+							65535,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_promoter.database",
+							"Database to connect to for the heartbeat table",
+							NULL,
+							&promoter_database,
+							"postgres",
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.heartbeat_table_interval",
+							"Specific time between writes to the heartbeat table on primary server",
+							"0 means not to use the heartbeat table.",
+							&promoter_heartbeat_table_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.notify_interval",
+							"Specific time between notifications to standby servers on primary server",
+							"0 means not to send notifications.",
+							&promoter_notify_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.wal_message_interval",
+							"Specific time between logical messages embedded in WAL on primary server",
+							"0 means not to embed messages.",
+							&promoter_wal_message_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.wal_message_timeout",
+							"Specific time within which a logical message must arrive in WAL to prove that primary server is alive",
+							"0 means not to read logical messages.",
+							&promoter_wal_message_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.heartbeat_table_timeout",
+							"Specific time within which the replayed heartbeat table must change to prove that primary server is alive",
+							"0 means to measure replication latency only.",
+							&promoter_heartbeat_table_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.tcp_keepalives_idle",
+							"Time between TCP keepalives on idle connections to primary server",
+							"0 means to use the system default.",
+							&promoter_tcp_keepalives_idle,
+							1,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.tcp_keepalives_interval",
+							"Time between TCP keepalive retransmits to primary server",
+							"0 means to use the system default.",
+							&promoter_tcp_keepalives_interval,
+							1,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.tcp_keepalives_count",
+							"Maximum number of TCP keepalive retransmits to primary server",
+							"0 means to use the system default.",
+							&promoter_tcp_keepalives_count,
+							3,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.tcp_user_timeout",
+							"Maximum time transmitted data to primary server may remain unacknowledged",
+							"0 means to use the system default.",
+							&promoter_tcp_user_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.connect_timeout",
+							"Maximum time to establish connection to primary server",
+							"0 means to wait up to pg_promoter.heartbeat_timeout.",
+							&promoter_connect_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.query_timeout",
+							"Maximum time to get the result of a heartbeat",
+							"0 means to wait up to pg_promoter.heartbeat_timeout.",
+							&promoter_query_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.catchup_timeout",
+							"Maximum time to wait for replay to catch up before promotion",
+							"0 means to promote at once.",
+							&promoter_catchup_timeout,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.prewarm_interval",
+							"Specific time between snapshots of hot blocks of primary server",
+							"0 means not to pre-warm buffers.",
+							&promoter_prewarm_interval,
+							0,
+							0,
+							INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_promoter.prewarm_blocks",
+							"Maximum number of hot blocks to pre-warm",
+							NULL,
+							&promoter_prewarm_blocks,
+							16384,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	EmitWarningsOnPlaceholders("pg_promoter");
+
+	/*
+	 * Request additional shared resources. (These are no-ops if we're not in
+	 * the postmaster process.)
+	 */
+	RequestAddinShmemSpace(promoterShmemSize());
+
+	/* Install hooks */
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = promoterShmemStartup;
+
 	/* set up common data for all our workers */
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
@@ -322,4 +5507,30 @@ _PG_init(void)
 	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_promoter");
 	worker.bgw_main_arg = Int32GetDatum(1);
 	RegisterBackgroundWorker(&worker);
+
+	/* The responder answers heartbeats once this server becomes primary */
+	if (promoter_responder_port > 0)
+	{
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = PromoterResponderMain;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_promoter responder");
+		worker.bgw_main_arg = (Datum) 0;
+		RegisterBackgroundWorker(&worker);
+	}
+
+	/* The heartbeat writer as well */
+	if (promoter_heartbeat_table_interval > 0 || promoter_notify_interval > 0 ||
+		promoter_wal_message_interval > 0)
+	{
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 1;
+		worker.bgw_main = PromoterHeartbeatWriterMain;
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pg_promoter heartbeat writer");
+		worker.bgw_main_arg = (Datum) 0;
+		RegisterBackgroundWorker(&worker);
+	}
 }
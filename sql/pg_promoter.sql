@@ -0,0 +1,18 @@
+CREATE EXTENSION pg_promoter;
+
+-- Functions refuse to work unless loaded by shared_preload_libraries
+SELECT * FROM pg_promoter_status();
+SELECT * FROM pg_promoter_paths();
+SELECT * FROM pg_promoter_timeline();
+SELECT * FROM pg_promoter_latency();
+SELECT * FROM pg_promoter_phases();
+SELECT pg_promoter_latency_reset();
+
+-- The heartbeat table has the only row
+SELECT id FROM pg_promoter_heartbeat;
+INSERT INTO pg_promoter_heartbeat VALUES (1, now());
+
+-- Only superusers can reset the latency
+SELECT has_function_privilege('public', 'pg_promoter_latency_reset()', 'execute');
+
+DROP EXTENSION pg_promoter;
@@ -0,0 +1,59 @@
+# Check that pg_promoter promotes the standby when primary server is gone
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 9;
+
+my $primary = get_new_node('primary');
+$primary->init(allows_streaming => 1);
+$primary->start;
+$primary->safe_psql('postgres', 'CREATE EXTENSION pg_promoter');
+$primary->backup('backup');
+
+my $standby = get_new_node('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+my $primary_conninfo =
+  'host=' . $primary->host . ' port=' . $primary->port . ' dbname=postgres';
+$standby->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_promoter'
+pg_promoter.primary_conninfo = '$primary_conninfo'
+pg_promoter.heartbeat_interval = 100ms
+pg_promoter.keepalives_count = 3
+));
+$standby->start;
+
+# The worker sees primary server through its only path
+ok( $standby->poll_query_until(
+		'postgres', "SELECT state = 'healthy' FROM pg_promoter_status()"),
+	'standby sees primary server');
+is($standby->safe_psql('postgres', 'SELECT count(*) FROM pg_promoter_paths()'),
+	'1', 'one path to primary server');
+is( $standby->safe_psql(
+		'postgres', 'SELECT string_agg(kind, \',\') FROM pg_promoter_latency()'),
+	'connect,query',
+	'latency of each kind');
+is( $standby->safe_psql(
+		'postgres', 'SELECT string_agg(phase, \',\') FROM pg_promoter_phases()'),
+	'dns,tcp,tls,auth,query',
+	'time of each phase');
+is($standby->safe_psql('postgres', 'SELECT pg_promoter_latency_reset()'),
+	'', 'latency can be reset');
+
+# Kill primary server, and the standby should be promoted
+$primary->stop('immediate');
+ok( $standby->poll_query_until('postgres', 'SELECT NOT pg_is_in_recovery()'),
+	'standby is promoted');
+ok( $standby->poll_query_until(
+		'postgres', "SELECT state = 'promoted' FROM pg_promoter_status()"),
+	'worker finished promotion');
+is( $standby->safe_psql(
+		'postgres',
+		"SELECT time IS NOT NULL FROM pg_promoter_timeline() WHERE stage = 'decision'"),
+	't',
+	'decision is recorded in the timeline');
+
+$standby->safe_psql('postgres', 'CREATE TABLE promoted (a int)');
+is($standby->safe_psql('postgres', 'SELECT count(*) FROM promoted'),
+	'0', 'promoted standby accepts writes');
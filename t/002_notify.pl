@@ -0,0 +1,53 @@
+# Check that pg_promoter with probe_method = notify keeps seeing a live
+# primary server, and promotes the standby once it's gone
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 4;
+
+my $primary = get_new_node('primary');
+$primary->init(allows_streaming => 1);
+my $primary_conninfo =
+  'host=' . $primary->host . ' port=' . $primary->port . ' dbname=postgres';
+
+# The heartbeat writer of primary server sends the notifications
+$primary->append_conf(
+	'postgresql.conf', qq(
+shared_preload_libraries = 'pg_promoter'
+pg_promoter.primary_conninfo = '$primary_conninfo'
+pg_promoter.notify_interval = 50ms
+));
+$primary->start;
+$primary->backup('backup');
+
+my $standby = get_new_node('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+$standby->append_conf(
+	'postgresql.conf', qq(
+pg_promoter.primary_conninfo = '$primary_conninfo'
+pg_promoter.probe_method = notify
+pg_promoter.heartbeat_interval = 300ms
+pg_promoter.keepalives_count = 3
+));
+$standby->start;
+
+ok( $standby->poll_query_until(
+		'postgres', "SELECT state = 'healthy' FROM pg_promoter_status()"),
+	'standby sees primary server by notifications');
+
+# A few heartbeats later, nothing has failed
+sleep 3;
+is( $standby->safe_psql(
+		'postgres',
+		"SELECT state || ',' || consecutive_failures || ',' || pg_is_in_recovery() FROM pg_promoter_status()"),
+	'healthy,0,t',
+	'standby stays healthy while notifications arrive');
+
+# Kill primary server, and the standby should be promoted
+$primary->stop('immediate');
+ok( $standby->poll_query_until('postgres', 'SELECT NOT pg_is_in_recovery()'),
+	'standby is promoted');
+ok( $standby->poll_query_until(
+		'postgres', "SELECT state = 'promoted' FROM pg_promoter_status()"),
+	'worker finished promotion');
@@ -0,0 +1,91 @@
+# Check that each way of polling primary server keeps seeing a live primary
+# server, and promotes the standby once it's gone. Notify mode is checked in
+# 002_notify.pl.
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 16;
+
+# Set up primary server and a standby with the given parameters, check that
+# the standby stays healthy as long as primary server runs, and that it's
+# promoted after primary server stops.
+sub check_probe_method
+{
+	my ($method, $primary_conf, $standby_conf, $healthy_sql) = @_;
+
+	my $primary = get_new_node("primary_$method");
+	$primary->init(allows_streaming => 1);
+	my $primary_conninfo =
+	    'host='
+	  . $primary->host
+	  . ' port='
+	  . $primary->port
+	  . ' dbname=postgres';
+	$primary->append_conf(
+		'postgresql.conf', qq(
+shared_preload_libraries = 'pg_promoter'
+pg_promoter.primary_conninfo = '$primary_conninfo'
+$primary_conf
+));
+	$primary->start;
+	$primary->safe_psql('postgres', 'CREATE EXTENSION pg_promoter');
+	$primary->backup('backup');
+
+	my $standby = get_new_node("standby_$method");
+	$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+	$standby->append_conf(
+		'postgresql.conf', qq(
+pg_promoter.primary_conninfo = '$primary_conninfo'
+pg_promoter.heartbeat_interval = 100ms
+pg_promoter.keepalives_count = 3
+$standby_conf
+));
+	$standby->start;
+
+	ok( $standby->poll_query_until(
+			'postgres', "SELECT state = 'healthy' FROM pg_promoter_status()"),
+		"$method: standby sees primary server");
+
+	# A few heartbeats later, nothing has failed
+	sleep 3;
+	is( $standby->safe_psql(
+			'postgres',
+			"SELECT state = 'healthy' AND consecutive_failures = 0 AND pg_is_in_recovery() AND $healthy_sql FROM pg_promoter_status()"
+		),
+		't',
+		"$method: standby stays healthy while primary server runs");
+
+	# Kill primary server, and the standby should be promoted
+	$primary->stop('immediate');
+	ok($standby->poll_query_until('postgres', 'SELECT NOT pg_is_in_recovery()'),
+		"$method: standby is promoted");
+	ok( $standby->poll_query_until(
+			'postgres', "SELECT state = 'promoted' FROM pg_promoter_status()"),
+		"$method: worker finished promotion");
+
+	$standby->stop;
+}
+
+check_probe_method('query', '', '', 'true');
+
+# The responder needs a UDP port of its own, reserved like that of a node
+my $responder_port = get_new_node('responder')->port;
+check_probe_method(
+	'udp',
+	"pg_promoter.responder_port = $responder_port",
+	"pg_promoter.probe_method = udp\npg_promoter.responder_port = $responder_port",
+	'true');
+
+# Messages in WAL and the heartbeat table prove that primary server is alive
+# by themselves, and give samples of the replication latency
+check_probe_method(
+	'wal_message',
+	'pg_promoter.wal_message_interval = 50ms',
+	'pg_promoter.wal_message_timeout = 1s',
+	'last_beat_time IS NOT NULL');
+check_probe_method(
+	'heartbeat_table',
+	'pg_promoter.heartbeat_table_interval = 50ms',
+	"pg_promoter.heartbeat_table_interval = 50ms\npg_promoter.heartbeat_table_timeout = 1s",
+	'last_beat_time IS NOT NULL');
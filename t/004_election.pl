@@ -0,0 +1,76 @@
+# Check that exactly one of the standbys which monitor the same primary server
+# promotes, and that the other one follows it
+use strict;
+use warnings;
+use PostgresNode;
+use TestLib;
+use Test::More tests => 4;
+
+my $primary = get_new_node('primary');
+$primary->init(allows_streaming => 1);
+$primary->start;
+$primary->safe_psql('postgres', 'CREATE EXTENSION pg_promoter');
+$primary->backup('backup');
+my $primary_conninfo =
+  'host=' . $primary->host . ' port=' . $primary->port . ' dbname=postgres';
+
+# Both standbys list each other as peers; standby1 is preferred
+my $standby1 = get_new_node('standby1');
+my $standby2 = get_new_node('standby2');
+my %priority = (standby1 => 200, standby2 => 100);
+foreach my $pair ([ $standby1, $standby2 ], [ $standby2, $standby1 ])
+{
+	my ($standby, $peer) = @$pair;
+	my $name = $standby->name;
+	my $peer_conninfo =
+	  'host=' . $peer->host . ' port=' . $peer->port . ' dbname=postgres';
+
+	$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+	$standby->append_conf(
+		'postgresql.conf', qq(
+cluster_name = '$name'
+shared_preload_libraries = 'pg_promoter'
+pg_promoter.primary_conninfo = '$primary_conninfo'
+pg_promoter.witness_conninfo = '$peer_conninfo'
+pg_promoter.election = on
+pg_promoter.priority = $priority{$name}
+pg_promoter.heartbeat_interval = 100ms
+pg_promoter.keepalives_count = 3
+));
+}
+$standby1->start;
+$standby2->start;
+
+foreach my $standby ($standby1, $standby2)
+{
+	$standby->poll_query_until('postgres',
+		"SELECT state = 'healthy' FROM pg_promoter_status()")
+	  or die "timed out waiting for " . $standby->name . " to see primary server";
+}
+
+# Kill primary server, and only the elected standby should be promoted
+$primary->stop('immediate');
+ok($standby1->poll_query_until('postgres', 'SELECT NOT pg_is_in_recovery()'),
+	'elected standby is promoted');
+
+# The other one polls the winner as new primary server, and stays standby
+my $followed = 0;
+foreach my $i (1 .. 180)
+{
+	if (slurp_file($standby2->logfile) =~
+		/has been promoted, monitoring it as primary server/)
+	{
+		$followed = 1;
+		last;
+	}
+	sleep 1;
+}
+ok($followed, 'other standby follows the winner');
+ok( $standby2->poll_query_until(
+		'postgres', "SELECT state = 'healthy' FROM pg_promoter_status()"),
+	'other standby sees the winner');
+is( join(',',
+		map { $_->safe_psql('postgres', 'SELECT pg_is_in_recovery()') }
+		  ($standby1, $standby2)),
+	'f,t',
+	'exactly one standby is promoted');